@@ -0,0 +1,226 @@
+#ifdef WITH_ARROW
+
+#include "arrowdatabase.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+static std::shared_ptr<arrow::DataType> time_type()
+{
+    return arrow::timestamp(arrow::TimeUnit::MILLI, "UTC");
+}
+
+static bool ends_with(const std::string& s, const char* suffix)
+{
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+arrow_database::arrow_database(bool r, const char* f)
+    : file(f),
+      t_builder(time_type(), arrow::default_memory_pool()),
+      slice_t_builder(time_type(), arrow::default_memory_pool())
+{
+    mode = ends_with(file, ".parquet") ? PARQUET : ends_with(file, ".arrows") ? IPC_STREAM : IPC_FILE;
+    rewrite = r;
+}
+
+arrow_database::~arrow_database()
+{
+    close();
+}
+
+bool arrow_database::check(const arrow::Status& status)
+{
+    if (status.ok())
+        return true;
+    fprintf(stderr, "Error: %s: %s\n", file.c_str(), status.ToString().c_str());
+    failed = true;
+    return false;
+}
+
+int arrow_database::exec(const char* sql)
+{
+    fprintf(stderr, "Error: %s is not an SQL database: %s\n", file.c_str(), sql);
+    return 1;
+}
+
+void arrow_database::open(std::shared_ptr<arrow::Schema> s)
+{
+    schema = s;
+    auto stream = arrow::io::FileOutputStream::Open(file);
+    if (!check(stream.status()))
+        return;
+    out = *stream;
+    if (mode == PARQUET)
+    {
+        // arrow schema is stored too, so readers get the dictionary and the time zone back
+        auto writer = parquet::arrow::FileWriter::Open(*schema, arrow::default_memory_pool(), out,
+                                                       parquet::WriterProperties::Builder().build(),
+                                                       parquet::ArrowWriterProperties::Builder().store_schema()->build());
+        if (check(writer.status()))
+            parquet_writer = std::move(*writer);
+    }
+    else
+    {
+        auto writer = mode == IPC_FILE ? arrow::ipc::MakeFileWriter(out, schema)
+                                       : arrow::ipc::MakeStreamWriter(out, schema);
+        if (check(writer.status()))
+            ipc_writer = *writer;
+    }
+    printf("%s: %s, %zu rows per %s\n", file.c_str(),
+           mode == PARQUET ? "parquet" : mode == IPC_FILE ? "arrow ipc file" : "arrow ipc stream",
+           row_group, mode == PARQUET ? "row group" : "record batch");
+}
+
+void arrow_database::init_db(std::vector<std::string> kks_array)
+{
+    resolve_ids(kks_array);
+    // index of a name in the dictionary is its id, ids start from 1
+    std::vector<std::string> names(1);
+    for (auto& k : kks_array)
+    {
+        int i = id(k);
+        if (i >= (int)names.size())
+            names.resize(i + 1);
+        names[i] = k;
+    }
+    arrow::StringBuilder builder;
+    if (!check(builder.AppendValues(names)) || !check(builder.Finish(&tag_names)))
+        return;
+    open(arrow::schema({arrow::field("id", arrow::dictionary(arrow::int32(), arrow::utf8())),
+                        arrow::field("t", time_type()),
+                        arrow::field("val", arrow::float64()),
+                        arrow::field("status", arrow::uint32())}));
+}
+
+void arrow_database::init_synchro(std::vector<std::string> kks_array)
+{
+    synchro_columns = kks_array;
+    if (kks_array.size()==0)
+    {
+        printf("no data in kks.csv");
+        return;
+    }
+    arrow::FieldVector fields;
+    for (auto& k : kks_array)
+    {
+        fields.push_back(arrow::field(k, arrow::float64()));
+        value_builders.emplace_back(new arrow::DoubleBuilder());
+    }
+    fields.push_back(arrow::field("timestamp", time_type()));
+    open(arrow::schema(fields));
+}
+
+void arrow_database::insert_dynamic(const dynamic_rows& r)
+{
+    if (failed || !schema)
+        return;
+    // every batch but the last one has exactly row_group rows
+    for (size_t from = 0; from < r.size() && !failed;)
+    {
+        size_t n = std::min(r.size() - from, row_group - rows);
+        if (!check(id_builder.Reserve(n)) || !check(status_builder.Reserve(n)) ||
+                !check(t_builder.AppendValues(r.t.data() + from, n)) ||
+                !check(val_builder.AppendValues(r.val.data() + from, n)))
+            return;
+        for (size_t i = from; i < from + n; i++)
+        {
+            id_builder.UnsafeAppend((int32_t)r.id[i]);
+            status_builder.UnsafeAppend((uint32_t)r.status[i]);
+        }
+        from += n;
+        rows += n;
+        if (rows >= row_group)
+            write_batch();
+    }
+}
+
+void arrow_database::insert_slices(const std::vector<slice>& slices)
+{
+    if (failed || !schema)
+        return;
+    for (auto& s : slices)
+    {
+        for (size_t i = 0; i < value_builders.size(); i++)
+        {
+            // no values of the tag in the slice
+            double v = i < s.values.size() ? s.values[i] : NAN;
+            check(std::isnan(v) ? value_builders[i]->AppendNull() : value_builders[i]->Append(v));
+        }
+        check(slice_t_builder.Append(s.t));
+        if (++rows >= row_group)
+            write_batch();
+    }
+}
+
+void arrow_database::write_batch()
+{
+    if (rows == 0 || failed)
+        return;
+    arrow::ArrayVector columns;
+    std::shared_ptr<arrow::Array> array;
+    if (value_builders.empty())
+    {
+        std::shared_ptr<arrow::Array> ids;
+        if (!check(id_builder.Finish(&ids)))
+            return;
+        auto dictionary = arrow::DictionaryArray::FromArrays(schema->field(0)->type(), ids, tag_names);
+        if (!check(dictionary.status()))
+            return;
+        columns.push_back(*dictionary);
+        for (arrow::ArrayBuilder* b : {(arrow::ArrayBuilder*)&t_builder, (arrow::ArrayBuilder*)&val_builder,
+                                       (arrow::ArrayBuilder*)&status_builder})
+        {
+            if (!check(b->Finish(&array)))
+                return;
+            columns.push_back(array);
+        }
+    }
+    else
+    {
+        for (auto& b : value_builders)
+        {
+            if (!check(b->Finish(&array)))
+                return;
+            columns.push_back(array);
+        }
+        if (!check(slice_t_builder.Finish(&array)))
+            return;
+        columns.push_back(array);
+    }
+    auto batch = arrow::RecordBatch::Make(schema, rows, columns);
+    if (parquet_writer)
+    {
+        auto table = arrow::Table::FromRecordBatches(schema, {batch});
+        if (check(table.status()))
+            check(parquet_writer->WriteTable(**table, rows));
+    }
+    else if (ipc_writer)
+        check(ipc_writer->WriteRecordBatch(*batch));
+    rows_written += rows;
+    batches++;
+    rows = 0;
+}
+
+void arrow_database::close()
+{
+    if (!out)
+        return;
+    write_batch();
+    if (parquet_writer)
+        check(parquet_writer->Close());
+    if (ipc_writer)
+        check(ipc_writer->Close());
+    check(out->Close());
+    out.reset();
+    printf("%s: %llu rows in %llu %s\n", file.c_str(), (unsigned long long)rows_written,
+           (unsigned long long)batches, mode == PARQUET ? "row groups" : "record batches");
+}
+
+void arrow_database::finalize_db()
+{
+    close();
+}
+
+#endif // WITH_ARROW
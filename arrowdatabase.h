@@ -0,0 +1,88 @@
+#ifndef ARROWDATABASE_H
+#define ARROWDATABASE_H
+
+#ifdef WITH_ARROW
+
+#include "sampleclient.h"
+#include <arrow/api.h>
+#include <arrow/io/file.h>
+#include <arrow/ipc/writer.h>
+#include <parquet/arrow/writer.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+// export of history (dynamic_data: id, t, val, status) or of slices (synchro_data: a column per tag
+// and timestamp) into a new file for pandas/polars/duckdb, without a database in between:
+//   *.arrow, *.feather - Arrow IPC file, memory-mapped by readers without deserialization
+//   *.arrows           - Arrow IPC stream
+//   *.parquet          - Parquet, one row group per batch
+// Rows are collected in builders and written as one record batch per row_group rows.
+// id is dictionary-encoded: the index is the static_data id, the dictionary holds tag names.
+// Every run writes the file again, there is nothing to resume or to deduplicate:
+// --resume, --skip-stored, --dedup and --follow are rejected with these files and history runs
+// keep no journal, so batches are written at row_group rows and by finalize_db only.
+class arrow_database : public database
+{
+public:
+    arrow_database(bool, const char*);
+    ~arrow_database();
+    void init_db(std::vector<std::string>);
+    // there is no SQL: prints an error
+    int exec(const char*);
+    void init_synchro(std::vector<std::string>);
+    // writes the last batch and the footer
+    void finalize_db();
+    void load_ids(std::unordered_map<std::string, int>&) {}
+    std::string now() {return format_time(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                              std::chrono::system_clock::now().time_since_epoch()).count());}
+    std::string timestamp(int64_t ms) {return format_time(ms);}
+    void insert_dynamic(const dynamic_rows&);
+    void insert_slices(const std::vector<slice>&);
+    tag_ranges time_ranges() {return tag_ranges();}
+    std::vector<int64_t> stored_times(int, int64_t, int64_t) {return std::vector<int64_t>();}
+
+    size_t row_group = 1 << 20;
+
+protected:
+    // ids live in the dictionary of the id column
+    void store_ids(const std::vector<std::pair<int, std::string>>&) {}
+
+private:
+    enum format
+    {
+        IPC_FILE,
+        IPC_STREAM,
+        PARQUET
+    };
+    bool check(const arrow::Status&);
+    void open(std::shared_ptr<arrow::Schema>);
+    void write_batch();
+    void close();
+
+    std::string file;
+    format mode;
+    std::shared_ptr<arrow::Schema> schema;
+    std::shared_ptr<arrow::io::FileOutputStream> out;
+    std::shared_ptr<arrow::ipc::RecordBatchWriter> ipc_writer;
+    std::unique_ptr<parquet::arrow::FileWriter> parquet_writer;
+    bool failed = false;
+
+    // dynamic_data
+    std::shared_ptr<arrow::Array> tag_names;
+    arrow::Int32Builder id_builder;
+    arrow::TimestampBuilder t_builder;
+    arrow::DoubleBuilder val_builder;
+    arrow::UInt32Builder status_builder;
+    // synchro_data
+    std::vector<std::unique_ptr<arrow::DoubleBuilder>> value_builders;
+    arrow::TimestampBuilder slice_t_builder;
+    size_t rows = 0;
+
+    uint64_t rows_written = 0;
+    uint64_t batches = 0;
+};
+
+#endif // WITH_ARROW
+
+#endif // ARROWDATABASE_H
@@ -25,6 +25,7 @@
 ******************************************************************************/
 #include "uaplatformlayer.h"
 #include "sampleclient.h"
+#include "onlinescheduler.h"
 #include "uathread.h"
 #include <stdlib.h>
 #include <getopt.h>
@@ -37,6 +38,13 @@ UaStatus status_run;
 SampleClient* pMyClient;
 bool exit_flag = false;
 bool online = false;
+int follow = 0;
+volatile sig_atomic_t dump_stats = 0;
+
+void statsSignalHandler(int)
+{
+    dump_stats = 1;
+}
 
 void signalHandler(int signum)
 {
@@ -44,6 +52,8 @@ void signalHandler(int signum)
        printf("Interrupt!\n");
        if (online)
            exit_flag = true;
+       else if (follow && pMyClient)
+           pMyClient->stop_follow = true;
        else {
 //           if (status_run.isGood())
 //           {
@@ -61,6 +71,40 @@ void signalHandler(int signum)
            exit(signum);
        }
 }
+// options without short form
+enum long_only_options
+{
+    OPT_MAX_NODES_PER_READ = 256,
+    OPT_IN_FLIGHT,
+    OPT_REGISTER_NODES,
+    OPT_OVERRUN,
+    OPT_WRITER_QUEUE,
+    OPT_WRITER_BATCH,
+    OPT_WRITER_FLUSH,
+    OPT_WRITER_OVERFLOW,
+    OPT_SQLITE_TEXT,
+    OPT_SQLITE_SYNCHRONOUS,
+    OPT_SQLITE_TRANSACTION,
+    OPT_HISTORY_WORKERS,
+    OPT_HISTORY_BATCH,
+    OPT_HISTORY_WINDOW_ROWS,
+    OPT_HISTORY_WINDOW,
+    OPT_HISTORY_QUEUE,
+    OPT_PAUSE_MIN,
+    OPT_PAUSE_MAX,
+    OPT_RECYCLE,
+    OPT_WATCHDOG,
+    OPT_JOURNAL,
+    OPT_RESUME,
+    OPT_FOLLOW,
+    OPT_FOLLOW_LAG,
+    OPT_AGGREGATE,
+    OPT_INTERVAL,
+    OPT_DEDUP,
+    OPT_SKIP_STORED,
+    OPT_ROW_GROUP,
+};
+
 /*============================================================================
  * main
  *===========================================================================*/
@@ -75,6 +119,7 @@ int main(int argc, char*argv[])
 
    signal(SIGINT, signalHandler);
    signal(SIGTERM, signalHandler);
+   signal(SIGUSR1, statsSignalHandler);
 
 	static struct option long_options[] =
 	{
@@ -88,7 +133,7 @@ int main(int argc, char*argv[])
 			{"help",0,NULL,'h'},
             {"begin", 0, NULL,'b'},
             {"end", 0, NULL,'e'},
-            {"pause", 0, NULL,'p'},
+            {"pause", 1, NULL,'p'},
             {"timeout", 0, NULL,'t'},
             {"read-bounds", 0, NULL,'r'},
             {"no-bounds", 0, NULL,'n'},
@@ -99,6 +144,35 @@ int main(int argc, char*argv[])
             {"opc-server",0,NULL,'a'},
             {"subscription",0,NULL,'S'},
             {"kks-file",0,NULL,'K'},
+            {"max-nodes-per-read",1,NULL,OPT_MAX_NODES_PER_READ},
+            {"in-flight",1,NULL,OPT_IN_FLIGHT},
+            {"register-nodes",0,NULL,OPT_REGISTER_NODES},
+            {"overrun",1,NULL,OPT_OVERRUN},
+            {"writer-queue",1,NULL,OPT_WRITER_QUEUE},
+            {"writer-batch",1,NULL,OPT_WRITER_BATCH},
+            {"writer-flush",1,NULL,OPT_WRITER_FLUSH},
+            {"writer-overflow",1,NULL,OPT_WRITER_OVERFLOW},
+            {"sqlite-text-insert",0,NULL,OPT_SQLITE_TEXT},
+            {"sqlite-synchronous",1,NULL,OPT_SQLITE_SYNCHRONOUS},
+            {"sqlite-transaction",1,NULL,OPT_SQLITE_TRANSACTION},
+            {"history-workers",1,NULL,OPT_HISTORY_WORKERS},
+            {"history-batch",1,NULL,OPT_HISTORY_BATCH},
+            {"history-window-rows",1,NULL,OPT_HISTORY_WINDOW_ROWS},
+            {"history-window",1,NULL,OPT_HISTORY_WINDOW},
+            {"history-queue",1,NULL,OPT_HISTORY_QUEUE},
+            {"pause-min",1,NULL,OPT_PAUSE_MIN},
+            {"pause-max",1,NULL,OPT_PAUSE_MAX},
+            {"recycle",1,NULL,OPT_RECYCLE},
+            {"watchdog",1,NULL,OPT_WATCHDOG},
+            {"journal",1,NULL,OPT_JOURNAL},
+            {"resume",0,NULL,OPT_RESUME},
+            {"follow",1,NULL,OPT_FOLLOW},
+            {"follow-lag",1,NULL,OPT_FOLLOW_LAG},
+            {"aggregate",1,NULL,OPT_AGGREGATE},
+            {"interval",1,NULL,OPT_INTERVAL},
+            {"dedup",0,NULL,OPT_DEDUP},
+            {"skip-stored",0,NULL,OPT_SKIP_STORED},
+            {"row-group",1,NULL,OPT_ROW_GROUP},
             {0, 0, 0, 0}
 	};
 
@@ -120,6 +194,32 @@ int main(int argc, char*argv[])
     std::string clickhouse = "";
     std::string csv_file = "";
     std::string opc_server = "";
+    unsigned int max_nodes_per_read = 0;
+    unsigned int max_in_flight = 0;
+    bool register_nodes = false;
+    online_scheduler::overrun_policy overrun_policy = online_scheduler::SKIP;
+    size_t writer_queue = 1024, writer_batch = 64;
+    int writer_flush = 1000;
+    bool sqlite_bulk = true;
+    std::string sqlite_synchronous = "NORMAL";
+    size_t sqlite_transaction_rows = 0;
+    int history_workers = 1;
+    OpcUa_UInt32 history_batch = 1;
+    uint64_t history_window_rows = 100000;
+    int history_window = 3600;
+    size_t history_queue = 16;
+    int pause_min = 10, pause_max = 0;
+    session_recycler::mode recycle_mode = session_recycler::ERRORS;
+    uint64_t recycle_limit = 0;
+    int watchdog = 5000;
+    std::string journal_file = "history.journal";
+    bool resume = false;
+    int follow_lag = 60;
+    OpcUa_UInt32 aggregate = 0;
+    double aggregate_interval = 60;
+    bool dedup = false, skip_stored = false;
+    int row_group = 1 << 20;
+    slice_writer::overflow_policy writer_overflow = slice_writer::BLOCK;
 	// loop over all of the options
 	int ch;
     while ((ch = getopt_long(argc, argv, "hou:f:d:m:s:b:e:p:t:rnwxk:ic:a:SK:", long_options, NULL)) != -1)
@@ -132,9 +232,14 @@ int main(int argc, char*argv[])
 --help(-h) this info\n\
 --opc-server (-a) opc server address \n\
 --clickhouse-server (-u) clickhouse server ip (table dynamic_data and static_data would be used)\n\
---file (-f) store result in local csv file\n\
+--file (-f) store result in local csv file (id, timestamp, value, numeric status code), \
+*.sqlite is sqlite database, *.tsdb directory is memory-mapped column store \
+(chunks per tag, delta timestamps, XOR values), *.arrow (*.feather), *.arrows and *.parquet are \
+Arrow IPC file, Arrow IPC stream and Parquet when built with WITH_ARROW, *.csv.zst or *.csv.lz4 \
+is compressed when built with WITH_ZSTD (-lzstd) or WITH_LZ4 (-llz4)\n\
 --ns(-s) number of space (1 by default)\n\
 --kks-file (-K) specify kks file (defult kks.csv)\n\
+--register-nodes register tags with RegisterNodes service and read them by registered ids\n\
 KKS  MODE:\n\
 --kks(-k) <id> kks browse mode. List subobjects from <id> object. \"all\" - from root folder, \"begin\" - \
 from begin of object folder. Results would be printed to out - or file, if  (-f) used \n\
@@ -145,21 +250,62 @@ ONLINE:\n\
 --delta(-d) miliseconds between reading from OPC UA, default 1000\n\
 --mean(-m) count of averaging: 1 means we don't calculate average and send each slice to DB, \
 5 - we calculate 5 slices to one mean and send it to DB. default 5\n\
+--max-nodes-per-read <n> tags in one Read request, default 0 - MaxNodesPerRead of server\n\
+--overrun <skip|catchup> cycles are aligned to wall-clock grid of delta; ticks missed by overrun \
+are skipped (default) or run without pause to catch up. Latency and jitter statistics are printed on SIGUSR1 and at exit\n\
+--writer-queue <n> slices waiting for database or csv writer, default 1024\n\
+--writer-batch <n> slices stored by one insert, default 64\n\
+--writer-flush <ms> store collected slices at least every ms, default 1000\n\
+--writer-overflow <block|drop|spill> when writer queue is full: wait (default), drop oldest slice \
+or append slice to spill.csv\n\
+--in-flight <n> read asynchronously with up to n requests at the same time, default 0 - synchronous read\n\
 SUBSCRIPTION:\n\
 --subscription(-S) subscription mode\n\
 HISTORY MODE:\n\
 --history(-i) history mode (default)\n\
 --begin(-b) <timestamp> in YYYY-MM-DDTHH:MM:SS.MMMZ format (e.g. 2021-06-01T00:00:00.000Z\n\
 --end(-e) <timestramp>\n\
---pause(-p) <miliseconds> pause between requests. default 5000. After successfull reading of each tag - \
-connection would be disconnected, wait 3*pause and reconnecetd. It's not recommended to set pause less, then 10. \
-It's not recommended to read more than 1 million records from one tag at one time - \
-use more short intervals (one month for example) foe big tags\n\
+--pause(-p) <miliseconds> starting pause before each request of a history session, default 50000. \
+The pause is shared but every --history-workers session waits it before its own request, so n sessions \
+send up to n requests per pause. The pause adapts to the server: \
+it shrinks while requests are answered quickly and doubles on timeouts, Bad statuses or slow responses. \
+The session is kept open and reconnected after errors only, see --recycle. \
+Long intervals are split into time windows automatically, see --history-window-rows\n\
 --timeout(-t) <ms> maximum timeout, that we are waiting for response from server\n\
 --read-bounds(-r) if we need to read bounds\n\
 --no-bounds(-n) if we don\'t want read bounds (default)\n\
 --rewrite(-w) rewrite db:e xisted tables dynamic_data and static_data would be dropped\n\
---read-bad(-x) read also bad values (default false)\n");
+--read-bad(-x) read also bad values (default false)\n\
+--sqlite-synchronous <OFF|NORMAL|FULL> PRAGMA synchronous of local sqlite file (WAL journal), default NORMAL\n\
+--sqlite-transaction <n> rows in one sqlite transaction, default 0 - one transaction per history page\n\
+--sqlite-text-insert insert to sqlite by SQL text instead of prepared statement (to compare rows/s)\n\
+--history-workers <n> sessions reading history in parallel, default 1\n\
+--history-batch <n> nodes per history read request, 0 - server MaxNodesPerHistoryReadData, default 1\n\
+--history-window-rows <n> target rows per tag in one time window, window length follows the tag density, \
+default 100000, 0 - whole interval in one request\n\
+--history-window <s> length of the first window, default 3600; window lengths are rounded down to a power \
+of two seconds (3600 -> 2048) so windows of different tags share edges\n\
+--history-queue <n> pages between fetch, decode and insert stages, default 16\n\
+--pause-min <ms> shortest adaptive pause, default 10\n\
+--pause-max <ms> longest adaptive pause, default 0 - 8 times -p but at least 1000 (400000 with the default -p); \
+set both to -p for a fixed pause\n\
+--recycle <errors|tags:n|rows:n|minutes:n> when history session is closed and opened again (waiting 3*pause): \
+after errors only (default) or also after n tags with data, n rows or n minutes. tags:1 - as in older versions\n\
+--watchdog <ms> session keep-alive check interval, default 5000\n\
+--journal <file> checkpoints of stored history per tag, default history.journal\n\
+--resume continue an interrupted run with the same -b/-e from the journal checkpoints; needs a database, \
+not a csv, Arrow or Parquet file, which every run writes anew\n\
+--follow <s> tail mode: every s seconds read history newer than the latest value of each tag in dynamic_data \
+(-b for tags without data) and append it, -e is not used. Ctrl-C stops after the current cycle\n\
+--follow-lag <s> tail mode reads up to s seconds before now, so late values are not missed, default 60\n\
+--aggregate <average|min|max|interpolative|timeaverage> read server-side aggregates (HistoryReadProcessed) \
+instead of raw values; one row per interval goes to synchro_data (or csv) as in online mode\n\
+--interval <s> processing interval of --aggregate, default 60\n\
+--dedup deduplicate dynamic_data on insert: unique (id,t) index with upsert in sqlite, ReplacingMergeTree in \
+clickhouse (new table, use -w; duplicates stay until a background merge, so queries need FINAL - slicer.py \
+adds it), the long dedup pass at the end of history mode is skipped\n\
+--skip-stored history rows whose tag and time are already in dynamic_data are not inserted, gaps are filled\n\
+--row-group <rows> rows per Arrow record batch or Parquet row group, default 1048576\n");
                 return 0;
             case 'o':
                 online = true;
@@ -248,6 +394,158 @@ use more short intervals (one month for example) foe big tags\n\
                 kks_file = optarg;
                 printf("kks file %s, ", kks_file.c_str());
                 break;
+            case OPT_MAX_NODES_PER_READ:
+                max_nodes_per_read = atoi(optarg);
+                printf("max nodes per read %u, ", max_nodes_per_read);
+                break;
+            case OPT_REGISTER_NODES:
+                register_nodes = true;
+                printf("register nodes, ");
+                break;
+            case OPT_OVERRUN:
+                if (std::string(optarg) == "catchup")
+                    overrun_policy = online_scheduler::CATCH_UP;
+                else if (std::string(optarg) == "skip")
+                    overrun_policy = online_scheduler::SKIP;
+                else
+                {
+                    printf("unknown overrun policy %s\n", optarg);
+                    exit(1);
+                }
+                printf("overrun %s, ", optarg);
+                break;
+            case OPT_WRITER_QUEUE:
+                writer_queue = atoi(optarg);
+                printf("writer queue %zu, ", writer_queue);
+                break;
+            case OPT_WRITER_BATCH:
+                writer_batch = atoi(optarg);
+                printf("writer batch %zu, ", writer_batch);
+                break;
+            case OPT_SQLITE_TEXT:
+                sqlite_bulk = false;
+                printf("sqlite text insert, ");
+                break;
+            case OPT_SQLITE_SYNCHRONOUS:
+                sqlite_synchronous = optarg;
+                printf("sqlite synchronous %s, ", sqlite_synchronous.c_str());
+                break;
+            case OPT_SQLITE_TRANSACTION:
+                sqlite_transaction_rows = atoi(optarg);
+                printf("sqlite transaction %zu, ", sqlite_transaction_rows);
+                break;
+            case OPT_HISTORY_WORKERS:
+                history_workers = atoi(optarg);
+                printf("history workers %d, ", history_workers);
+                break;
+            case OPT_HISTORY_BATCH:
+                history_batch = atoi(optarg);
+                printf("history batch %u, ", history_batch);
+                break;
+            case OPT_HISTORY_WINDOW_ROWS:
+                history_window_rows = strtoull(optarg, NULL, 10);
+                printf("history window rows %llu, ", (unsigned long long)history_window_rows);
+                break;
+            case OPT_HISTORY_WINDOW:
+                history_window = atoi(optarg);
+                printf("history window %d, ", history_window);
+                break;
+            case OPT_HISTORY_QUEUE:
+                history_queue = atoi(optarg);
+                printf("history queue %zu, ", history_queue);
+                break;
+            case OPT_PAUSE_MIN:
+                pause_min = atoi(optarg);
+                printf("pause min %d, ", pause_min);
+                break;
+            case OPT_PAUSE_MAX:
+                pause_max = atoi(optarg);
+                printf("pause max %d, ", pause_max);
+                break;
+            case OPT_RECYCLE:
+                if (!session_recycler::parse(optarg, recycle_mode, recycle_limit))
+                {
+                    printf("unknown session recycle policy %s\n", optarg);
+                    exit(1);
+                }
+                printf("recycle %s, ", optarg);
+                break;
+            case OPT_WATCHDOG:
+                watchdog = atoi(optarg);
+                printf("watchdog %d, ", watchdog);
+                break;
+            case OPT_JOURNAL:
+                journal_file = optarg;
+                printf("journal %s, ", journal_file.c_str());
+                break;
+            case OPT_RESUME:
+                resume = true;
+                printf("resume, ");
+                break;
+            case OPT_FOLLOW:
+                follow = atoi(optarg);
+                printf("follow %d, ", follow);
+                break;
+            case OPT_FOLLOW_LAG:
+                follow_lag = atoi(optarg);
+                printf("follow lag %d, ", follow_lag);
+                break;
+            case OPT_AGGREGATE:
+                if (std::string(optarg) == "average")
+                    aggregate = OpcUaId_AggregateFunction_Average;
+                else if (std::string(optarg) == "min")
+                    aggregate = OpcUaId_AggregateFunction_Minimum;
+                else if (std::string(optarg) == "max")
+                    aggregate = OpcUaId_AggregateFunction_Maximum;
+                else if (std::string(optarg) == "interpolative")
+                    aggregate = OpcUaId_AggregateFunction_Interpolative;
+                else if (std::string(optarg) == "timeaverage")
+                    aggregate = OpcUaId_AggregateFunction_TimeAverage;
+                else
+                {
+                    printf("unknown aggregate %s\n", optarg);
+                    exit(1);
+                }
+                printf("aggregate %s, ", optarg);
+                break;
+            case OPT_INTERVAL:
+                aggregate_interval = atof(optarg);
+                printf("interval %g, ", aggregate_interval);
+                break;
+            case OPT_DEDUP:
+                dedup = true;
+                printf("dedup, ");
+                break;
+            case OPT_SKIP_STORED:
+                skip_stored = true;
+                printf("skip stored, ");
+                break;
+            case OPT_ROW_GROUP:
+                row_group = atoi(optarg);
+                printf("row group %d, ", row_group);
+                break;
+            case OPT_WRITER_FLUSH:
+                writer_flush = atoi(optarg);
+                printf("writer flush %d, ", writer_flush);
+                break;
+            case OPT_WRITER_OVERFLOW:
+                if (std::string(optarg) == "block")
+                    writer_overflow = slice_writer::BLOCK;
+                else if (std::string(optarg) == "drop")
+                    writer_overflow = slice_writer::DROP_OLDEST;
+                else if (std::string(optarg) == "spill")
+                    writer_overflow = slice_writer::SPILL;
+                else
+                {
+                    printf("unknown writer overflow policy %s\n", optarg);
+                    exit(1);
+                }
+                printf("writer overflow %s, ", optarg);
+                break;
+            case OPT_IN_FLIGHT:
+                max_in_flight = atoi(optarg);
+                printf("in flight %u, ", max_in_flight);
+                break;
 
 
 	    }
@@ -275,7 +573,7 @@ use more short intervals (one month for example) foe big tags\n\
             printf("begin time not pointed");
             exit(1);
         }
-        if (end == "")
+        if (end == "" && !follow)
         {
             printf("end time not pointed");
             exit(1);
@@ -296,6 +594,21 @@ use more short intervals (one month for example) foe big tags\n\
     }
     if (clickhouse != "")
         printf("using clickhouse\n");
+    // Arrow and Parquet files are written anew by every run: nothing stored to resume, skip or follow
+    std::string ext = csv_file.substr(std::min(csv_file.find_last_of('.'), csv_file.size()));
+    bool arrow_file = ext == ".arrow" || ext == ".feather" || ext == ".arrows" || ext == ".parquet";
+    if (arrow_file && (resume || skip_stored || dedup || follow))
+    {
+        printf("--resume, --skip-stored, --dedup and --follow can't be used with %s\n", csv_file.c_str());
+        exit(1);
+    }
+    // a csv file is truncated by every run as well: --resume would skip windows whose rows were in it
+    bool sqlite_file = csv_file.size() >= 6 && csv_file.substr(csv_file.size() - 6) == "sqlite";
+    if (resume && csv_file != "" && !arrow_file && !sqlite_file && ext != ".tsdb")
+    {
+        printf("--resume can't be used with csv output %s\n", csv_file.c_str());
+        exit(1);
+    }
 //    printf("rewrite = %s \n", rewrite?"true":"false");
 
     // Initialize the UA Stack platform layer
@@ -303,6 +616,36 @@ use more short intervals (one month for example) foe big tags\n\
 
     // Create instance of SampleClient
     pMyClient = new SampleClient(delta,mean,ns,rewrite,read_bad,clickhouse,csv_file,kks_file);
+    pMyClient->max_nodes_per_read = max_nodes_per_read;
+    pMyClient->max_in_flight = max_in_flight;
+    pMyClient->register_nodes = register_nodes;
+    pMyClient->writer_queue = writer_queue;
+    pMyClient->writer_batch = writer_batch;
+    pMyClient->writer_flush_ms = writer_flush;
+    pMyClient->sqlite_bulk = sqlite_bulk;
+    pMyClient->sqlite_synchronous = sqlite_synchronous;
+    pMyClient->sqlite_transaction_rows = sqlite_transaction_rows;
+    pMyClient->history_workers = history_workers;
+    pMyClient->history_batch = history_batch;
+    pMyClient->history_window_rows = history_window_rows;
+    pMyClient->history_window_s = history_window;
+    pMyClient->history_queue = history_queue;
+    pMyClient->pause_min = pause_min;
+    pMyClient->pause_max = pause_max;
+    pMyClient->recycle_mode = recycle_mode;
+    pMyClient->recycle_limit = recycle_limit;
+    pMyClient->watchdog_ms = watchdog;
+    pMyClient->journal_file = journal_file;
+    pMyClient->resume = resume;
+    pMyClient->follow_s = follow;
+    pMyClient->follow_lag_s = follow_lag;
+    if (aggregate)
+        pMyClient->aggregate = aggregate;
+    pMyClient->aggregate_interval_s = aggregate_interval;
+    pMyClient->dedup = dedup;
+    pMyClient->skip_stored = skip_stored;
+    pMyClient->arrow_row_group = row_group;
+    pMyClient->writer_overflow = writer_overflow;
 
     // Connect to OPC UA Server
     status_run = pMyClient->connect(opc_server);
@@ -313,12 +656,20 @@ use more short intervals (one month for example) foe big tags\n\
         {
             // Read values one time
             pMyClient->online_db_init();
+            online_scheduler scheduler(delta, overrun_policy);
             while(!exit_flag)
             {
-                auto start  = std::chrono::system_clock::now();
-                status_run = pMyClient->read_online();
-                std::this_thread::sleep_until(start + std::chrono::milliseconds(delta));
+                auto tick = scheduler.wait_next();
+                status_run = pMyClient->read_online(tick);
+                scheduler.cycle_done();
+                if (dump_stats)
+                {
+                    dump_stats = 0;
+                    scheduler.print_stats(stdout);
+                    pMyClient->print_online_stats(stdout);
+                }
             }
+            scheduler.print_stats(stdout);
         }
         else if (kks_mode)
         {
@@ -326,7 +677,10 @@ use more short intervals (one month for example) foe big tags\n\
         }
         else if (history_mode)
         {
-            status_run = pMyClient->readHistory(begin.c_str(),end.c_str(),pause,timeout,read_bounds);
+            if (aggregate)
+                status_run = pMyClient->readProcessed(begin.c_str(),end.c_str(),pause,timeout);
+            else
+                status_run = pMyClient->readHistory(begin.c_str(),end.c_str(),pause,timeout,read_bounds);
         }
         else if (subscription_mode)
         {
@@ -0,0 +1,283 @@
+#include "csvsink.h"
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+
+void csv_append_int(std::string& out, int64_t v)
+{
+    char buffer[24];
+    auto r = std::to_chars(buffer, buffer + sizeof(buffer), v);
+    out.append(buffer, r.ptr - buffer);
+}
+
+void csv_append_double(std::string& out, double v)
+{
+    char buffer[32];
+    auto r = std::to_chars(buffer, buffer + sizeof(buffer), v);
+    out.append(buffer, r.ptr - buffer);
+}
+
+static char* put2(char* p, unsigned v)
+{
+    p[0] = '0' + v / 10;
+    p[1] = '0' + v % 10;
+    return p + 2;
+}
+
+void csv_append_time(std::string& out, int64_t ms)
+{
+    int64_t days = ms / 86400000;
+    int64_t rest = ms % 86400000;
+    if (rest < 0)
+    {
+        rest += 86400000;
+        days--;
+    }
+    // civil date from days since 1970-01-01 (H. Hinnant's algorithm), no gmtime call per row
+    int64_t z = days + 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    unsigned doe = (unsigned)(z - era * 146097);
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t year = (int64_t)yoe + era * 400;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    unsigned day = doy - (153 * mp + 2) / 5 + 1;
+    unsigned month = mp < 10 ? mp + 3 : mp - 9;
+    if (month <= 2)
+        year++;
+
+    char buffer[24];
+    char* p = buffer;
+    unsigned y = (unsigned)year;
+    p = put2(p, y / 100 % 100);
+    p = put2(p, y % 100);
+    *p++ = '-';
+    p = put2(p, month);
+    *p++ = '-';
+    p = put2(p, day);
+    *p++ = ' ';
+    unsigned seconds = (unsigned)(rest / 1000);
+    p = put2(p, seconds / 3600);
+    *p++ = ':';
+    p = put2(p, seconds / 60 % 60);
+    *p++ = ':';
+    p = put2(p, seconds % 60);
+    *p++ = '.';
+    unsigned millis = (unsigned)(rest % 1000);
+    *p++ = '0' + millis / 100;
+    p = put2(p, millis % 100);
+    out.append(buffer, p - buffer);
+}
+
+static bool ends_with(const std::string& s, const char* suffix)
+{
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+csv_sink::csv_sink(size_t buffer_size) : buffer(buffer_size)
+{
+}
+
+csv_sink::~csv_sink()
+{
+    close();
+}
+
+bool csv_sink::open(const std::string& f)
+{
+    close();
+    name = f;
+    mode = NONE;
+    if (ends_with(f, ".zst"))
+        mode = ZSTD;
+    else if (ends_with(f, ".lz4"))
+        mode = LZ4;
+#ifndef WITH_ZSTD
+    if (mode == ZSTD)
+    {
+        fprintf(stderr, "Error: %s: the client is built without zstd (WITH_ZSTD)\n", f.c_str());
+        return false;
+    }
+#endif
+#ifndef WITH_LZ4
+    if (mode == LZ4)
+    {
+        fprintf(stderr, "Error: %s: the client is built without lz4 (WITH_LZ4)\n", f.c_str());
+        return false;
+    }
+#endif
+    file = fopen(f.c_str(), "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Error: can't create %s: %s\n", f.c_str(), strerror(errno));
+        return false;
+    }
+    // the buffer of the sink is large enough, stdio one would only copy it again
+    setvbuf(file, nullptr, _IONBF, 0);
+    failed = false;
+    used = 0;
+    bytes_in = bytes_out = 0;
+    last_drain = std::chrono::steady_clock::now();
+#ifdef WITH_ZSTD
+    if (mode == ZSTD)
+    {
+        zstd = ZSTD_createCCtx();
+        ZSTD_CCtx_setParameter(zstd, ZSTD_c_compressionLevel, level);
+        compressed.resize(ZSTD_CStreamOutSize());
+    }
+#endif
+#ifdef WITH_LZ4
+    if (mode == LZ4)
+    {
+        LZ4F_createCompressionContext(&lz4, LZ4F_VERSION);
+        LZ4F_preferences_t prefs;
+        memset(&prefs, 0, sizeof(prefs));
+        prefs.frameInfo.blockSizeID = LZ4F_max4MB;
+        compressed.resize(LZ4F_compressBound(buffer.size(), &prefs));
+        size_t n = LZ4F_compressBegin(lz4, compressed.data(), compressed.size(), &prefs);
+        if (LZ4F_isError(n))
+        {
+            fprintf(stderr, "Error: lz4 %s: %s\n", f.c_str(), LZ4F_getErrorName(n));
+            failed = true;
+        }
+        else
+            write_file(compressed.data(), n);
+    }
+#endif
+    printf("csv file %s: %zu KiB buffer, %s\n", f.c_str(), buffer.size() >> 10,
+           mode == ZSTD ? "zstd" : mode == LZ4 ? "lz4" : "not compressed");
+    return true;
+}
+
+void csv_sink::write(const char* data, size_t size)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!file)
+        return;
+    bytes_in += size;
+    while (size > 0)
+    {
+        size_t n = std::min(size, buffer.size() - used);
+        memcpy(buffer.data() + used, data, n);
+        used += n;
+        data += n;
+        size -= n;
+        if (used == buffer.size())
+            drain(false, false);
+    }
+    if (flush_ms > 0 && std::chrono::steady_clock::now() - last_drain >= std::chrono::milliseconds(flush_ms))
+        drain(true, false);
+}
+
+void csv_sink::flush()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (file)
+        drain(true, false);
+}
+
+void csv_sink::close()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!file)
+        return;
+    drain(true, true);
+#ifdef WITH_ZSTD
+    if (zstd)
+    {
+        ZSTD_freeCCtx(zstd);
+        zstd = nullptr;
+    }
+#endif
+#ifdef WITH_LZ4
+    if (lz4)
+    {
+        LZ4F_freeCompressionContext(lz4);
+        lz4 = nullptr;
+    }
+#endif
+    fclose(file);
+    file = nullptr;
+    print_stats(stdout);
+}
+
+void csv_sink::write_file(const char* data, size_t size)
+{
+    if (failed || size == 0)
+        return;
+    if (fwrite(data, 1, size, file) != size)
+    {
+        fprintf(stderr, "Error: writing %s: %s\n", name.c_str(), strerror(errno));
+        failed = true;
+        return;
+    }
+    bytes_out += size;
+}
+
+void csv_sink::drain(bool sync, bool end)
+{
+    // used by the compressors only
+    (void)sync;
+    (void)end;
+    last_drain = std::chrono::steady_clock::now();
+    switch (mode)
+    {
+    case NONE:
+        write_file(buffer.data(), used);
+        break;
+    case ZSTD:
+#ifdef WITH_ZSTD
+    {
+        ZSTD_EndDirective directive = end ? ZSTD_e_end : sync ? ZSTD_e_flush : ZSTD_e_continue;
+        ZSTD_inBuffer in = {buffer.data(), used, 0};
+        for (;;)
+        {
+            ZSTD_outBuffer out = {compressed.data(), compressed.size(), 0};
+            size_t left = ZSTD_compressStream2(zstd, &out, &in, directive);
+            if (ZSTD_isError(left))
+            {
+                fprintf(stderr, "Error: zstd %s: %s\n", name.c_str(), ZSTD_getErrorName(left));
+                failed = true;
+                break;
+            }
+            write_file(compressed.data(), out.pos);
+            if (directive == ZSTD_e_continue ? in.pos == in.size : left == 0)
+                break;
+        }
+    }
+#endif
+        break;
+    case LZ4:
+#ifdef WITH_LZ4
+    {
+        size_t n = LZ4F_compressUpdate(lz4, compressed.data(), compressed.size(), buffer.data(), used, nullptr);
+        if (!LZ4F_isError(n))
+            write_file(compressed.data(), n);
+        if (!LZ4F_isError(n) && (sync || end))
+        {
+            n = end ? LZ4F_compressEnd(lz4, compressed.data(), compressed.size(), nullptr)
+                    : LZ4F_flush(lz4, compressed.data(), compressed.size(), nullptr);
+            if (!LZ4F_isError(n))
+                write_file(compressed.data(), n);
+        }
+        if (LZ4F_isError(n))
+        {
+            fprintf(stderr, "Error: lz4 %s: %s\n", name.c_str(), LZ4F_getErrorName(n));
+            failed = true;
+        }
+    }
+#endif
+        break;
+    }
+    used = 0;
+    if (sync)
+        fflush(file);
+}
+
+void csv_sink::print_stats(FILE* out) const
+{
+    fprintf(out, "csv file %s: %llu bytes of text, %llu bytes written%s\n", name.c_str(),
+            (unsigned long long)bytes_in, (unsigned long long)bytes_out, failed ? ", write failed" : "");
+}
@@ -0,0 +1,82 @@
+#ifndef CSVSINK_H
+#define CSVSINK_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef WITH_LZ4
+#include <lz4frame.h>
+#endif
+
+// csv fields appended to a line without printf and without temporary strings
+void csv_append_int(std::string& out, int64_t);
+// shortest text that reads back to the same double
+void csv_append_double(std::string& out, double);
+// "YYYY-MM-DD HH:MM:SS.mmm" in UTC, as format_time
+void csv_append_time(std::string& out, int64_t ms);
+
+// output csv file of history, online and subscription modes.
+// Text is collected in a large buffer and written (or compressed) when it is full,
+// when flush_ms passed since the last write to the file, on flush() and on close().
+// File names ending with .zst or .lz4 are compressed as one streaming frame
+// if the client is built with WITH_ZSTD or WITH_LZ4.
+// Writes from several threads are serialized.
+class csv_sink
+{
+public:
+    enum compression
+    {
+        NONE,
+        ZSTD,
+        LZ4
+    };
+
+    explicit csv_sink(size_t buffer_size = 4 << 20);
+    ~csv_sink();
+
+    // false with a message if the file can not be created or its compression is not built in
+    bool open(const std::string& file);
+    bool is_open() const { return file != nullptr; }
+    void write(const char* data, size_t size);
+    void write(const std::string& text) { write(text.data(), text.size()); }
+    // everything written so far is in the file, readable by a decompressor
+    void flush();
+    // ends the compressed frame and closes the file
+    void close();
+    void print_stats(FILE*) const;
+
+    int flush_ms = 1000;
+    int level = 3;      // zstd compression level
+
+private:
+    // buffer goes to the file; end - last block of the compressed frame
+    void drain(bool sync, bool end);
+    void write_file(const char* data, size_t size);
+
+    FILE* file = nullptr;
+    std::string name;
+    compression mode = NONE;
+    std::vector<char> buffer;
+    size_t used = 0;
+    std::vector<char> compressed;
+    std::chrono::steady_clock::time_point last_drain;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    bool failed = false;
+    std::mutex mutex;
+#ifdef WITH_ZSTD
+    ZSTD_CCtx* zstd = nullptr;
+#endif
+#ifdef WITH_LZ4
+    LZ4F_cctx* lz4 = nullptr;
+#endif
+};
+
+#endif // CSVSINK_H
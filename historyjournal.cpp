@@ -0,0 +1,79 @@
+#include "historyjournal.h"
+#include <unistd.h>
+
+history_journal::history_journal(const std::string& f, int64_t b, int64_t e, bool resume)
+    : file_name(f), begin(b), end(e)
+{
+    if (resume && !load())
+        checkpoints.clear();
+    // the journal is rewritten with one line per tag, so it doesn't grow from run to run;
+    // the old one is replaced only when the new one is on disk
+    std::string tmp = file_name + ".tmp";
+    file = fopen(tmp.c_str(), "w");
+    if (!file)
+    {
+        fprintf(stderr, "Error: can't open journal %s\n", tmp.c_str());
+        return;
+    }
+    fprintf(file, "range %lld %lld\n", (long long)begin, (long long)end);
+    for (auto& c : checkpoints)
+        fprintf(file, "%s %lld\n", c.first.c_str(), (long long)c.second);
+    fflush(file);
+    fsync(fileno(file));
+    if (rename(tmp.c_str(), file_name.c_str()) != 0)
+        fprintf(stderr, "Error: can't replace journal %s\n", file_name.c_str());
+}
+
+history_journal::~history_journal()
+{
+    commit();
+    if (file)
+        fclose(file);
+}
+
+bool history_journal::load()
+{
+    FILE* in = fopen(file_name.c_str(), "r");
+    if (!in)
+    {
+        fprintf(stderr, "Error: no journal %s to resume, starting from the beginning\n", file_name.c_str());
+        return false;
+    }
+    long long b, e;
+    if (fscanf(in, "range %lld %lld", &b, &e) != 2 || b != begin || e != end)
+    {
+        fprintf(stderr, "Error: journal %s is of another time range, starting from the beginning\n", file_name.c_str());
+        fclose(in);
+        return false;
+    }
+    char kks[1024];
+    long long from;
+    // a line cut by the interruption doesn't parse and ends the journal
+    while (fscanf(in, "%1023s %lld", kks, &from) == 2)
+        checkpoints[kks] = from;
+    fclose(in);
+    printf("resuming from %s: %zu tags with checkpoints\n", file_name.c_str(), checkpoints.size());
+    return true;
+}
+
+int64_t history_journal::start(const std::string& kks) const
+{
+    auto it = checkpoints.find(kks);
+    return it == checkpoints.end() ? begin : it->second;
+}
+
+void history_journal::stage(const std::string& kks, int64_t from)
+{
+    staged.emplace_back(kks, from);
+}
+
+void history_journal::commit()
+{
+    if (!file || staged.empty())
+        return;
+    for (auto& s : staged)
+        fprintf(file, "%s %lld\n", s.first.c_str(), (long long)s.second);
+    staged.clear();
+    fflush(file);
+    fsync(fileno(file));
+}
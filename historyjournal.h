@@ -0,0 +1,38 @@
+#ifndef HISTORYJOURNAL_H
+#define HISTORYJOURNAL_H
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+// checkpoints of a history run: for each tag the time (unix ms) before which all its rows
+// of the -b/-e range are stored. Lines "kks ms" are appended after the database commits them,
+// the last line of a tag wins. The first line is "range begin end" of the run.
+class history_journal
+{
+public:
+    // resume - continue the journal of an interrupted run with the same range,
+    // otherwise it is started anew
+    history_journal(const std::string& file, int64_t begin, int64_t end, bool resume);
+    ~history_journal();
+
+    // where the tag continues: begin of the range if it has no checkpoint
+    int64_t start(const std::string& kks) const;
+    // checkpoint of rows handed to the database, written by commit()
+    void stage(const std::string& kks, int64_t from);
+    // database has committed everything staged so far
+    void commit();
+
+private:
+    std::string file_name;
+    int64_t begin;
+    int64_t end;
+    FILE* file = nullptr;
+    std::map<std::string, int64_t> checkpoints;
+    std::vector<std::pair<std::string, int64_t>> staged;
+    bool load();
+};
+
+#endif // HISTORYJOURNAL_H
@@ -0,0 +1,240 @@
+#include "historypipeline.h"
+#include <algorithm>
+
+static int64_t elapsed_us(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - since).count();
+}
+
+void stage_stats::print(FILE* out, const char* name, int threads, double seconds) const
+{
+    double total = seconds * 1e6 * (threads > 0 ? threads : 1);
+    fprintf(out, "  %-8s %d thread(s) %llu pages: busy %5.1f%%, blocked by next stage %5.1f%%, waiting for input %5.1f%%\n",
+            name, threads, (unsigned long long)items.load(), 100.0 * busy_us / total,
+            100.0 * blocked_us / total, 100.0 * idle_us / total);
+}
+
+history_pipeline::history_pipeline(database* d, csv_sink* csv, std::mutex& m, bool bad, size_t capacity,
+                                   history_journal* j, bool skip)
+    : db(d), csv_out(csv), db_mutex(m), read_bad(bad), journal(j), skip_stored(skip), raw(capacity), decoded(capacity),
+      start(std::chrono::steady_clock::now()), last_commit(start)
+{
+    decoder = std::thread(&history_pipeline::decode, this);
+    writer = std::thread(&history_pipeline::write, this);
+}
+
+history_pipeline::~history_pipeline()
+{
+    close();
+}
+
+void history_pipeline::push(int id, const std::string& kks, UaDataValues& values)
+{
+    raw_page page;
+    page.id = id;
+    page.kks = kks;
+    page.length = values.length();
+    page.values = values.detach();
+    page.checkpoint = -1;
+    page.window = false;
+    auto t = std::chrono::steady_clock::now();
+    raw.push(std::move(page));
+    fetch_stats.blocked_us += elapsed_us(t);
+    fetch_stats.items++;
+}
+
+void history_pipeline::push_checkpoint(const std::string& kks, int64_t from)
+{
+    raw_page page;
+    page.id = 0;
+    page.kks = kks;
+    page.length = 0;
+    page.values = nullptr;
+    page.checkpoint = from;
+    page.window = true;
+    raw.push(std::move(page));
+}
+
+void history_pipeline::fetched(std::chrono::steady_clock::duration request, std::chrono::steady_clock::duration pause)
+{
+    fetch_stats.busy_us += std::chrono::duration_cast<std::chrono::microseconds>(request).count();
+    fetch_stats.idle_us += std::chrono::duration_cast<std::chrono::microseconds>(pause).count();
+}
+
+void history_pipeline::close()
+{
+    if (closed)
+        return;
+    closed = true;
+    raw.close();
+    decoder.join();
+    writer.join();
+}
+
+void history_pipeline::decode_page(raw_page& page, decoded_page& out)
+{
+    // data values are freed with this array
+    UaDataValues dataValues;
+    if (page.values)
+        dataValues.attach(page.length, page.values);
+    out.kks = page.kks;
+    out.checkpoint = page.checkpoint;
+    out.window = page.window;
+    if (db)
+        out.rows.reserve(dataValues.length());
+    else
+        out.csv.reserve(dataValues.length() * (page.kks.size() + 56));
+    for (OpcUa_UInt32 j = 0; j < dataValues.length(); j++)
+    {
+        const OpcUa_DataValue& dataValue = dataValues[j];
+        // values come in time order, everything up to the last one is in this page
+        if (page.checkpoint < 0)
+            out.checkpoint = std::max(out.checkpoint, to_unix_ms(dataValue.SourceTimestamp) + 1);
+        if ( !read_bad && !OpcUa_IsGood(dataValue.StatusCode) )
+            continue;
+        if (!db) // using local csv file
+        {
+            out.csv.append(page.kks).append(1, ',');
+            csv_append_time(out.csv, to_unix_ms(dataValue.SourceTimestamp));
+            out.csv.append(1, ',');
+            const OpcUa_Variant& v = dataValue.Value;
+            double value;
+            if (v.Datatype == OpcUaType_Boolean && v.ArrayType == OpcUa_VariantArrayType_Scalar)
+                out.csv.append(v.Value.Boolean ? "true" : "false");
+            else if (v.Datatype == OpcUaType_Null)
+                ;
+            else if (v.Datatype != OpcUaType_String && to_double(v, value))
+                csv_append_double(out.csv, value);
+            else // text as is, rare: numeric strings and tags dropped after their first page
+                out.csv.append(UaVariant(v).toString().toUtf8());
+            // numeric status code, UaStatus(code).toString() gives its name
+            out.csv.append(1, ',');
+            csv_append_int(out.csv, dataValue.StatusCode);
+            out.csv.append(1, '\n');
+        }
+        else
+        {
+            // columns are filled straight from the data value, no text in between
+            OpcUa_Double value;
+            if (!to_double(dataValue.Value, value))
+                continue;
+            out.rows.id.push_back(page.id);
+            out.rows.t.push_back(to_unix_ms(dataValue.SourceTimestamp));
+            out.rows.val.push_back(value);
+            out.rows.status.push_back(dataValue.StatusCode);
+        }
+    }
+}
+
+void history_pipeline::drop_stored(dynamic_rows& rows)
+{
+    auto range = std::minmax_element(rows.t.begin(), rows.t.end());
+    std::vector<int64_t> stored = db->stored_times((int)rows.id[0], *range.first, *range.second);
+    if (stored.empty())
+        return;
+    size_t kept = 0;
+    for (size_t i = 0; i < rows.size(); i++)
+    {
+        if (std::binary_search(stored.begin(), stored.end(), rows.t[i]))
+        {
+            overlapping++;
+            continue;
+        }
+        rows.id[kept] = rows.id[i];
+        rows.t[kept] = rows.t[i];
+        rows.val[kept] = rows.val[i];
+        rows.status[kept] = rows.status[i];
+        kept++;
+    }
+    rows.id.resize(kept);
+    rows.t.resize(kept);
+    rows.val.resize(kept);
+    rows.status.resize(kept);
+}
+
+void history_pipeline::decode()
+{
+    raw_page page;
+    for (;;)
+    {
+        auto t = std::chrono::steady_clock::now();
+        if (!raw.pop(page))
+            break;
+        decode_stats.idle_us += elapsed_us(t);
+        t = std::chrono::steady_clock::now();
+        decoded_page out;
+        decode_page(page, out);
+        decode_stats.busy_us += elapsed_us(t);
+        decode_stats.items++;
+        if (out.rows.size() == 0 && out.csv.empty() && (!journal || out.checkpoint < 0))
+            continue;
+        t = std::chrono::steady_clock::now();
+        decoded.push(std::move(out));
+        decode_stats.blocked_us += elapsed_us(t);
+    }
+    decoded.close();
+}
+
+void history_pipeline::write()
+{
+    decoded_page page;
+    for (;;)
+    {
+        auto t = std::chrono::steady_clock::now();
+        if (!decoded.pop(page))
+            break;
+        write_stats.idle_us += elapsed_us(t);
+        t = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(db_mutex);
+            // looked up here: rows of earlier pages are in the database already
+            if (skip_stored && page.rows.size())
+                drop_stored(page.rows);
+            if (db && page.rows.size())
+                db->insert_dynamic(page.rows);
+            else if (!db && !page.csv.empty())
+                csv_out->write(page.csv);
+            if (journal && page.checkpoint >= 0)
+            {
+                journal->stage(page.kks, page.checkpoint);
+                // checkpoints of pages stay staged, the journal is written at window checkpoints only:
+                // buffered csv rows reach the file before it
+                if (page.window && !db)
+                {
+                    csv_out->flush();
+                    journal->commit();
+                }
+                else if (page.window)
+                {
+                    // rows of an open sqlite transaction or of open column store chunks are not stored yet;
+                    // the database commits them on its own schedule (--sqlite-transaction, full chunks),
+                    // it is forced only when the journal would lag more than COMMIT_INTERVAL_MS
+                    auto now = std::chrono::steady_clock::now();
+                    if (db->uncommitted() && now - last_commit >= std::chrono::milliseconds(COMMIT_INTERVAL_MS))
+                        db->commit();
+                    if (!db->uncommitted())
+                    {
+                        journal->commit();
+                        last_commit = now;
+                    }
+                }
+            }
+        }
+        write_stats.busy_us += elapsed_us(t);
+        write_stats.items++;
+    }
+}
+
+void history_pipeline::print_stats(FILE* out, int fetchers) const
+{
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (seconds <= 0)
+        seconds = 1e-3;
+    fprintf(out, "history pipeline: %.1f s, queue max depth raw=%zu/%zu decoded=%zu/%zu\n", seconds,
+            raw.max_depth, raw.capacity, decoded.max_depth, decoded.capacity);
+    if (skip_stored)
+        fprintf(out, "  %llu rows dropped as already stored\n", (unsigned long long)overlapping.load());
+    fetch_stats.print(out, "fetch", fetchers, seconds);
+    decode_stats.print(out, "decode", 1, seconds);
+    write_stats.print(out, "write", 1, seconds);
+}
@@ -0,0 +1,145 @@
+#ifndef HISTORYPIPELINE_H
+#define HISTORYPIPELINE_H
+
+#include "sampleclient.h"
+#include "historyjournal.h"
+#include "csvsink.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// bounded blocking queue, any number of producers and consumers
+template <class T>
+class bounded_queue
+{
+public:
+    explicit bounded_queue(size_t capacity) : capacity(capacity > 0 ? capacity : 1) {}
+
+    // waits while the queue is full
+    void push(T&& value)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this]{return items.size() < capacity;});
+        items.push_back(std::move(value));
+        if (items.size() > max_depth)
+            max_depth = items.size();
+        not_empty.notify_one();
+    }
+
+    // waits while the queue is empty, false when it is closed and empty
+    bool pop(T& value)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this]{return !items.empty() || closed;});
+        if (items.empty())
+            return false;
+        value = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+    size_t max_depth = 0;
+    const size_t capacity;
+
+private:
+    std::deque<T> items;
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+};
+
+// time of one pipeline stage: working, waiting for the next stage (full queue)
+// and waiting for input (empty queue, pause between requests)
+struct stage_stats
+{
+    std::atomic<uint64_t> items{0};
+    std::atomic<int64_t> busy_us{0};
+    std::atomic<int64_t> blocked_us{0};
+    std::atomic<int64_t> idle_us{0};
+    void print(FILE*, const char* name, int threads, double seconds) const;
+};
+
+// history pages go fetcher (history workers) -> decoder thread -> writer thread,
+// so the next page is requested while the previous one is converted and stored.
+// Full queues stop the stage before them.
+class history_pipeline
+{
+public:
+    // journal - checkpoints of stored rows, may be null;
+    // skip_stored - rows with the tag and time of a row in dynamic_data are dropped
+    history_pipeline(database*, csv_sink* csv, std::mutex& db_mutex, bool read_bad, size_t capacity,
+                     history_journal* journal, bool skip_stored);
+    ~history_pipeline();
+
+    // called by fetchers: takes the data values of the page, the result is left empty
+    void push(int id, const std::string& kks, UaDataValues& values);
+    // rows of the tag before from are all pushed: checkpoint once they are stored
+    void push_checkpoint(const std::string& kks, int64_t from);
+    // time of a fetcher in the request and in the pause before it
+    void fetched(std::chrono::steady_clock::duration request, std::chrono::steady_clock::duration pause);
+    // waits until every pushed page is stored
+    void close();
+    void print_stats(FILE*, int fetchers) const;
+
+    // a database that doesn't commit on its own is committed at a window checkpoint
+    // once this time has passed since the journal was last written
+    static constexpr int COMMIT_INTERVAL_MS = 5000;
+
+private:
+    struct raw_page
+    {
+        int id;
+        std::string kks;
+        OpcUa_UInt32 length;
+        OpcUa_DataValue* values;
+        int64_t checkpoint;     // -1 - after the last value of the page
+        bool window;            // checkpoint of a whole window from push_checkpoint
+    };
+    struct decoded_page
+    {
+        dynamic_rows rows;
+        std::string csv;
+        std::string kks;
+        int64_t checkpoint = -1;
+        bool window = false;
+    };
+    void decode();
+    void write();
+    void decode_page(raw_page&, decoded_page&);
+    // rows of one page are of one tag: its stored times in the page range are looked up once
+    void drop_stored(dynamic_rows&);
+
+    database* db;
+    csv_sink* csv_out;
+    std::mutex& db_mutex;
+    bool read_bad;
+    history_journal* journal;
+    bool skip_stored;
+    std::atomic<uint64_t> overlapping{0};
+    bounded_queue<raw_page> raw;
+    bounded_queue<decoded_page> decoded;
+    std::thread decoder;
+    std::thread writer;
+    bool closed = false;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point last_commit;
+    stage_stats fetch_stats, decode_stats, write_stats;
+};
+
+#endif // HISTORYPIPELINE_H
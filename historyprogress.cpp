@@ -0,0 +1,175 @@
+#include "historyprogress.h"
+#include <algorithm>
+
+history_progress::history_progress(size_t n_tags, int workers, const std::string& failed_file,
+                                   int64_t begin, int64_t end, int64_t first_window, uint64_t window_rows,
+                                   const std::vector<int64_t>& starts)
+    : n_tags(n_tags), range_begin(begin), range_end(end), window_rows(window_rows), workers(workers),
+      start(std::chrono::steady_clock::now())
+{
+    static std::mutex files_mutex;
+    static std::set<std::string> files;
+    {
+        std::lock_guard<std::mutex> lock(files_mutex);
+        bool first = files.insert(failed_file).second;
+        failed_kks.open(failed_file, first ? std::ios::out | std::ios::trunc : std::ios::out | std::ios::app);
+    }
+    if (window_rows == 0 || first_window <= 0)
+        first_window = end - begin;
+    else
+        first_window = grid_length(first_window);
+    window.assign(n_tags, first_window);
+    reached.assign(n_tags, begin);
+    for (size_t slot = 0; slot < n_tags; slot++)
+    {
+        history_task task;
+        task.slot = slot;
+        task.start = slot < starts.size() ? std::max(starts[slot], begin) : begin;
+        reached[slot] = task.start;
+        if (task.start >= end)
+        {
+            done++;
+            continue;
+        }
+        task.end = window_end(task.start, first_window);
+        queue.push_back(task);
+    }
+    if (done)
+        printf("%zu tags are already read\n", done);
+}
+
+int64_t history_progress::grid_length(int64_t length) const
+{
+    int64_t grid = MIN_WINDOW_MS;
+    while (grid * 2 <= length)
+        grid *= 2;
+    return grid;
+}
+
+int64_t history_progress::window_end(int64_t start, int64_t length) const
+{
+    // one window per tag for the whole range
+    if (window_rows == 0)
+        return std::min(start + length, range_end);
+    return std::min(range_begin + ((start - range_begin) / length + 1) * length, range_end);
+}
+
+bool history_progress::next(std::vector<history_task>& batch, size_t max)
+{
+    batch.clear();
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this]{return !queue.empty() || in_flight == 0;});
+    if (queue.empty())
+        return false;
+    batch.push_back(queue.front());
+    queue.pop_front();
+    // one request has one time range: windows with the same start join the batch
+    // and all of them end where the shortest one does
+    int64_t end = batch[0].end;
+    for (auto it = queue.begin(); it != queue.end() && batch.size() < max; )
+    {
+        if (it->start == batch[0].start)
+        {
+            end = std::min(end, it->end);
+            batch.push_back(*it);
+            it = queue.erase(it);
+        }
+        else
+            ++it;
+    }
+    for (auto& task : batch)
+        task.end = end;
+    in_flight += batch.size();
+    return true;
+}
+
+bool history_progress::window_done(int worker, const std::string& kks, history_task& task)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    in_flight--;
+    workers[worker].windows++;
+    workers[worker].rows += task.window_rows;
+    task.rows += task.window_rows;
+    if (task.retry && task.retries >= MAX_RETRIES)
+    {
+        task.retry = false;
+        task.failed = true;
+        failed_kks << kks << " pushed back " << task.retries + 1 << " times\n";
+        failed_kks.flush();
+    }
+    if (task.retry)
+    {
+        // rows before read_to are pushed already
+        task.start = std::max(task.start, std::min(task.read_to, task.end));
+        reached[task.slot] = task.start;
+    }
+    else if (!task.failed)
+        reached[task.slot] = task.end;
+    bool last = task.failed || (task.retry ? task.start : task.end) >= range_end;
+    if (!last && task.retry)
+    {
+        task.retries++;
+        task.retry = false;
+        task.end = window_end(task.start, window[task.slot]);
+        task.read_to = 0;
+        task.window_rows = 0;
+        queue.push_back(task);
+    }
+    else if (!last)
+    {
+        task.retries = 0;
+        int64_t& length = window[task.slot];
+        if (window_rows)
+        {
+            // rows per ms of the window just read give the length of the next one,
+            // growth is limited since an empty window says little about the following data
+            int64_t read = task.end - task.start;
+            int64_t next = task.window_rows ? (int64_t)(read * ((double)window_rows / task.window_rows)) : read * 4;
+            length = grid_length(std::min(next, read * 4));
+        }
+        task.start = task.end;
+        task.end = window_end(task.start, length);
+        task.window_rows = 0;
+        queue.push_back(task);
+    }
+    else
+    {
+        done++;
+        workers[worker].tags++;
+        printf("worker %d: %s done, %llu rows, %zu/%zu tags\n", worker, kks.c_str(),
+               (unsigned long long)task.rows, done, n_tags);
+    }
+    cv.notify_all();
+    return last;
+}
+
+std::vector<int64_t> history_progress::positions() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return reached;
+}
+
+void history_progress::failed(const std::string& kks, const std::string& reason)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    failed_kks << kks << " " << reason << "\n";
+    failed_kks.flush();
+}
+
+void history_progress::print(FILE* f) const
+{
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (seconds <= 0)
+        seconds = 1e-3;
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t total = 0;
+    fprintf(f, "\nhistory workers: %zu, %.1f s\n", workers.size(), seconds);
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        fprintf(f, "  worker %zu: %llu tags, %llu windows, %llu rows, %.0f rows/s\n", i,
+                (unsigned long long)workers[i].tags, (unsigned long long)workers[i].windows,
+                (unsigned long long)workers[i].rows, workers[i].rows / seconds);
+        total += workers[i].rows;
+    }
+    fprintf(f, "  total: %llu rows, %.0f rows/s\n", (unsigned long long)total, total / seconds);
+}
@@ -0,0 +1,89 @@
+#ifndef HISTORYPROGRESS_H
+#define HISTORYPROGRESS_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+// one time window of one tag, times are unix ms, window is [start, end)
+struct history_task
+{
+    size_t slot;
+    int64_t start;
+    int64_t end;
+    int id = -1;                // db id of the tag, -1 - not resolved yet
+    uint64_t rows = 0;          // rows of the tag read in previous windows
+    uint64_t window_rows = 0;   // rows of this window
+    bool failed = false;        // tag is dropped: service error or text field
+    bool retry = false;         // server pushed back: the window is read again from read_to
+    int64_t read_to = 0;        // after the last row of the window pushed so far
+    int retries = 0;            // push backs in a row
+};
+
+// shared state of history workers: queue of tag windows, failed_kks.csv and per-worker counters.
+// After each window the next window of the tag is sized by its observed density and goes to
+// the back of the queue, so windows of different tags interleave.
+class history_progress
+{
+public:
+    // failed_file is truncated by the first history_progress of the process and appended to by
+    // the next ones (follow cycles);
+    // window_rows - target rows per window, 0 - whole [begin, end) in one window per tag;
+    // starts - where each tag begins (resumed run), empty - at begin
+    history_progress(size_t n_tags, int workers, const std::string& failed_file,
+                     int64_t begin, int64_t end, int64_t first_window, uint64_t window_rows,
+                     const std::vector<int64_t>& starts);
+
+    // takes up to max windows with the same start, the batch ends at the earliest end of them;
+    // waits while other workers may still put windows back; false when everything is read
+    bool next(std::vector<history_task>& batch, size_t max);
+    // returns the window read by worker, true if it was the last window of the tag;
+    // a window to retry goes back to the queue from read_to with the same length
+    bool window_done(int worker, const std::string& kks, history_task& task);
+    void failed(const std::string& kks, const std::string& reason);
+    void print(FILE*) const;
+    // for each tag: time up to which its windows are read
+    std::vector<int64_t> positions() const;
+
+    // shortest window the density estimate may go down to
+    static const int64_t MIN_WINDOW_MS = 1000;
+    // push backs in a row after which the tag is dropped
+    static const int MAX_RETRIES = 5;
+
+private:
+    struct worker_stats
+    {
+        uint64_t tags = 0;
+        uint64_t windows = 0;
+        uint64_t rows = 0;
+    };
+    // window lengths are MIN_WINDOW_MS times a power of two and windows end on multiples of
+    // their length from range_begin, so tags of different density still meet at the same edges
+    int64_t grid_length(int64_t length) const;
+    int64_t window_end(int64_t start, int64_t length) const;
+
+    size_t n_tags;
+    int64_t range_begin;
+    int64_t range_end;
+    uint64_t window_rows;
+    std::deque<history_task> queue;
+    std::vector<int64_t> window;    // current window length of each tag
+    std::vector<int64_t> reached;   // end of the last window read without failure
+    size_t in_flight = 0;
+    size_t done = 0;
+    std::vector<worker_stats> workers;
+    std::chrono::steady_clock::time_point start;
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::ofstream failed_kks;
+};
+
+#endif // HISTORYPROGRESS_H
@@ -0,0 +1,668 @@
+#include "mmapdatabase.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// files grow by at least this much, so appends seldom remap
+static const size_t MIN_GROWTH = 64 << 20;
+
+static void put_varint(std::vector<uint8_t>& out, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        out.push_back((uint8_t)v | 0x80);
+        v >>= 7;
+    }
+    out.push_back((uint8_t)v);
+}
+
+static uint64_t get_varint(const uint8_t*& p)
+{
+    uint64_t v = 0;
+    int shift = 0;
+    while (*p & 0x80)
+    {
+        v |= (uint64_t)(*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    return v | (uint64_t)*p++ << shift;
+}
+
+static uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+// most significant bit first
+class bit_writer
+{
+public:
+    explicit bit_writer(std::vector<uint8_t>& o) : out(o) {}
+    void put(uint64_t v, int n)
+    {
+        while (n > 0)
+        {
+            if (used == 8)
+            {
+                out.push_back(0);
+                used = 0;
+            }
+            int k = std::min(n, 8 - used);
+            out.back() |= ((v >> (n - k)) & ((1u << k) - 1)) << (8 - used - k);
+            used += k;
+            n -= k;
+        }
+    }
+
+private:
+    std::vector<uint8_t>& out;
+    int used = 8;
+};
+
+static uint64_t double_bits(double v)
+{
+    uint64_t b;
+    memcpy(&b, &v, sizeof(b));
+    return b;
+}
+
+chunk_cursor::chunk_cursor(const uint8_t* data, const chunk_entry& e)
+    : ts(data + e.offset), vs(ts + e.t_bytes), ss(vs + e.v_bytes), left(e.count)
+{
+}
+
+uint64_t chunk_cursor::bits(int n)
+{
+    uint64_t v = 0;
+    while (n > 0)
+    {
+        int used = bit & 7;
+        int k = std::min(n, 8 - used);
+        v = (v << k) | ((vs[bit >> 3] >> (8 - used - k)) & ((1u << k) - 1));
+        bit += k;
+        n -= k;
+    }
+    return v;
+}
+
+bool chunk_cursor::next(int64_t& t_out, double& val_out, uint32_t& status_out)
+{
+    if (left == 0)
+        return false;
+    left--;
+    int64_t dod = unzigzag(get_varint(ts));
+    if (first)
+    {
+        t = dod;
+        value = bits(64);
+        first = false;
+    }
+    else
+    {
+        delta += dod;
+        t += delta;
+        // XOR with the previous value: 0 - the same, 10 - meaningful bits in the previous window,
+        // 11 - 5 bits of leading zeros, 6 bits of length - 1, meaningful bits
+        if (bits(1))
+        {
+            if (bits(1))
+            {
+                leading = (int)bits(5);
+                int length = (int)bits(6) + 1;
+                trailing = 64 - leading - length;
+            }
+            value ^= bits(64 - leading - trailing) << trailing;
+        }
+    }
+    if (run == 0)
+    {
+        run = get_varint(ss);
+        code = (uint32_t)get_varint(ss);
+    }
+    run--;
+    t_out = t;
+    memcpy(&val_out, &value, sizeof(val_out));
+    status_out = code;
+    return true;
+}
+
+bool mmap_database::mapped_file::open(const std::string& file)
+{
+    fd = ::open(file.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: can't open %s: %s\n", file.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    size = capacity = st.st_size;
+    if (capacity > 0)
+    {
+        void* p = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            fprintf(stderr, "Error: can't map %s: %s\n", file.c_str(), strerror(errno));
+            ::close(fd);
+            fd = -1;
+            return false;
+        }
+        data = (uint8_t*)p;
+    }
+    return true;
+}
+
+uint8_t* mmap_database::mapped_file::append(size_t bytes)
+{
+    if (fd < 0)
+        return nullptr;
+    if (size + bytes > capacity)
+    {
+        size_t grown = std::max({capacity * 2, size + bytes, MIN_GROWTH});
+        if (ftruncate(fd, grown) != 0)
+        {
+            fprintf(stderr, "Error: can't grow mapped file to %zu bytes: %s\n", grown, strerror(errno));
+            return nullptr;
+        }
+        void* p = data ? mremap(data, capacity, grown, MREMAP_MAYMOVE)
+                       : mmap(nullptr, grown, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            fprintf(stderr, "Error: can't map %zu bytes: %s\n", grown, strerror(errno));
+            return nullptr;
+        }
+        data = (uint8_t*)p;
+        capacity = grown;
+    }
+    uint8_t* p = data + size;
+    size += bytes;
+    return p;
+}
+
+void mmap_database::mapped_file::close()
+{
+    if (fd < 0)
+        return;
+    if (data)
+    {
+        msync(data, capacity, MS_SYNC);
+        munmap(data, capacity);
+    }
+    // the grown tail is not data
+    if (ftruncate(fd, size) != 0)
+        fprintf(stderr, "Error: can't truncate mapped file: %s\n", strerror(errno));
+    ::close(fd);
+    fd = -1;
+    data = nullptr;
+    size = capacity = 0;
+}
+
+mmap_database::mmap_database(bool r, const char* d) : dir(d)
+{
+    if (mkdir(d, 0755) != 0 && errno != EEXIST)
+        fprintf(stderr, "Error: can't create directory %s: %s\n", d, strerror(errno));
+    rewrite = r;
+}
+
+mmap_database::~mmap_database()
+{
+    commit();
+    columns.close();
+    synchro.close();
+    if (index_fd >= 0)
+        close(index_fd);
+}
+
+std::string mmap_database::path(const char* file) const
+{
+    return dir + "/" + file;
+}
+
+int mmap_database::exec(const char* sql)
+{
+    fprintf(stderr, "Error: %s is not an SQL database: %s\n", dir.c_str(), sql);
+    return 1;
+}
+
+void mmap_database::open_files()
+{
+    if (index_fd >= 0)
+        return;
+    if (!columns.open(path("dynamic_data.col")))
+        return;
+    index_fd = ::open(path("dynamic_data.idx").c_str(), O_RDWR | O_CREAT, 0644);
+    if (index_fd < 0)
+    {
+        fprintf(stderr, "Error: can't open %s: %s\n", path("dynamic_data.idx").c_str(), strerror(errno));
+        return;
+    }
+    // chunks are written before their entries: an entry past the end of the data
+    // or a part of an entry is what an interrupted run left
+    struct stat st;
+    fstat(index_fd, &st);
+    std::vector<chunk_entry> entries(st.st_size / sizeof(chunk_entry));
+    ssize_t bytes = entries.empty() ? 0 : pread(index_fd, entries.data(), entries.size() * sizeof(chunk_entry), 0);
+    size_t n = bytes > 0 ? bytes / sizeof(chunk_entry) : 0;
+    size_t valid = 0;
+    columns.size = 0;
+    for (; valid < n && entries[valid].end() <= columns.capacity; valid++)
+    {
+        const chunk_entry& e = entries[valid];
+        chunks[e.id].push_back(e);
+        columns.size = std::max(columns.size, (size_t)e.end());
+        int64_t& last = last_t.emplace(e.id, e.last_t).first->second;
+        last = std::max(last, e.last_t);
+    }
+    if (valid * sizeof(chunk_entry) != (size_t)st.st_size &&
+            ftruncate(index_fd, valid * sizeof(chunk_entry)) != 0)
+        fprintf(stderr, "Error: can't truncate %s: %s\n", path("dynamic_data.idx").c_str(), strerror(errno));
+    lseek(index_fd, 0, SEEK_END);
+    synced = columns.size;
+    printf("%s: %zu chunks of %zu tags, %zu bytes\n", dir.c_str(), valid, chunks.size(), columns.size);
+}
+
+void mmap_database::init_db(std::vector<std::string> kks_array)
+{
+    if (rewrite)
+    {
+        printf("remove %s/dynamic_data.* and static_data.csv\n", dir.c_str());
+        unlink(path("dynamic_data.col").c_str());
+        unlink(path("dynamic_data.idx").c_str());
+        unlink(path("static_data.csv").c_str());
+    }
+    open_files();
+    resolve_ids(kks_array);
+}
+
+void mmap_database::load_ids(std::unordered_map<std::string, int>& ids)
+{
+    FILE* f = fopen(path("static_data.csv").c_str(), "r");
+    if (!f)
+        return;
+    char line[1024];
+    while (fgets(line, sizeof(line), f))
+    {
+        char* comma = strchr(line, ',');
+        if (!comma)
+            continue;
+        line[strcspn(line, "\r\n")] = 0;
+        ids[comma + 1] = atoi(line);
+    }
+    fclose(f);
+}
+
+void mmap_database::store_ids(const std::vector<std::pair<int, std::string>>& added)
+{
+    FILE* f = fopen(path("static_data.csv").c_str(), "a");
+    if (!f)
+    {
+        fprintf(stderr, "Error: can't write %s: %s\n", path("static_data.csv").c_str(), strerror(errno));
+        return;
+    }
+    for (auto& k : added)
+        fprintf(f, "%d,%s\n", k.first, k.second.c_str());
+    fclose(f);
+}
+
+void mmap_database::init_synchro(std::vector<std::string> kks_array)
+{
+    synchro_columns = kks_array;
+    if (kks_array.size()==0)
+    {
+        printf("no data in kks.csv");
+        return;
+    }
+    std::string names_file = path("synchro_data.csv");
+    if (rewrite)
+    {
+        unlink(path("synchro_data.col").c_str());
+        unlink(names_file.c_str());
+    }
+    std::string names;
+    for (auto& k : kks_array)
+        names += k + "\n";
+    // slices of other tags can't be appended to the same rows
+    std::ifstream stored(names_file);
+    if (stored)
+    {
+        std::string stored_names((std::istreambuf_iterator<char>(stored)), std::istreambuf_iterator<char>());
+        if (stored_names != names)
+        {
+            fprintf(stderr, "Error: %s has other tags, use -w to start synchro_data again\n", names_file.c_str());
+            return;
+        }
+    }
+    else
+        std::ofstream(names_file) << names;
+    if (!synchro.open(path("synchro_data.col")))
+        return;
+    // rows are t and one value per tag; zero t at the end is the grown part of an interrupted run
+    size_t row = sizeof(int64_t) * (1 + kks_array.size());
+    synchro.size -= synchro.size % row;
+    while (synchro.size >= row && *(int64_t*)(synchro.data + synchro.size - row) == 0)
+        synchro.size -= row;
+    printf("%s: %zu slices in synchro_data\n", dir.c_str(), synchro.size / row);
+}
+
+void mmap_database::insert_slices(const std::vector<slice>& slices)
+{
+    size_t row = sizeof(int64_t) * (1 + synchro_columns.size());
+    uint8_t* p = synchro.append(row * slices.size());
+    if (!p)
+        return;
+    for (auto& s : slices)
+    {
+        memcpy(p, &s.t, sizeof(int64_t));
+        memcpy(p + sizeof(int64_t), s.values.data(), std::min(s.values.size(), synchro_columns.size()) * sizeof(double));
+        p += row;
+    }
+}
+
+void mmap_database::insert_dynamic(const dynamic_rows& rows)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (size_t from = 0; from < rows.size();)
+    {
+        // rows of a page belong to one tag
+        int id = (int)rows.id[from];
+        size_t to = from + 1;
+        while (to < rows.size() && (int)rows.id[to] == id)
+            to++;
+        open_chunk& chunk = open[id];
+        int64_t& last = last_t.emplace(id, INT64_MIN).first->second;
+        // times of the tag already stored in the range of the rows: rows after the last stored one,
+        // the usual case, need no lookup; a backfill looks into the chunks it overlaps
+        std::vector<int64_t> stored;
+        if (ingest_dedup)
+        {
+            auto range = std::minmax_element(rows.t.begin() + from, rows.t.begin() + to);
+            if (*range.first <= last)
+                stored = stored_times(id, *range.first, *range.second);
+        }
+        for (size_t i = from; i < to; i++)
+        {
+            if (!stored.empty() && std::binary_search(stored.begin(), stored.end(), rows.t[i]))
+            {
+                rows_dropped++;
+                continue;
+            }
+            last = std::max(last, rows.t[i]);
+            chunk.t.push_back(rows.t[i]);
+            chunk.val.push_back(rows.val[i]);
+            chunk.status.push_back((uint32_t)rows.status[i]);
+            open_rows++;
+            rows_inserted++;
+            if (chunk.t.size() >= chunk_rows)
+                seal(id, chunk);
+        }
+        from = to;
+    }
+    insert_time += std::chrono::steady_clock::now() - start;
+}
+
+void mmap_database::seal(int id, open_chunk& chunk)
+{
+    size_t n = chunk.t.size();
+    if (n == 0)
+        return;
+    std::vector<uint8_t> ts, vs, ss;
+    ts.reserve(n * 2);
+    vs.reserve(n * 4);
+    chunk_entry e;
+    memset(&e, 0, sizeof(e));
+    e.id = id;
+    e.count = (uint32_t)n;
+    e.first_t = *std::min_element(chunk.t.begin(), chunk.t.end());
+    e.last_t = *std::max_element(chunk.t.begin(), chunk.t.end());
+
+    // timestamps: the first one, then change of the step, mostly a single 0 byte for periodic tags
+    put_varint(ts, zigzag(chunk.t[0]));
+    int64_t delta = 0;
+    for (size_t i = 1; i < n; i++)
+    {
+        int64_t d = chunk.t[i] - chunk.t[i - 1];
+        put_varint(ts, zigzag(d - delta));
+        delta = d;
+    }
+
+    // values: Gorilla XOR, an unchanged value is one bit
+    bit_writer bits(vs);
+    uint64_t prev = double_bits(chunk.val[0]);
+    bits.put(prev, 64);
+    int leading = -1, trailing = 0;
+    for (size_t i = 1; i < n; i++)
+    {
+        uint64_t cur = double_bits(chunk.val[i]);
+        uint64_t x = cur ^ prev;
+        prev = cur;
+        if (x == 0)
+        {
+            bits.put(0, 1);
+            continue;
+        }
+        int lz = std::min(__builtin_clzll(x), 31);
+        int tz = __builtin_ctzll(x);
+        if (leading >= 0 && lz >= leading && tz >= trailing)
+        {
+            bits.put(2, 2);
+            bits.put(x >> trailing, 64 - leading - trailing);
+        }
+        else
+        {
+            leading = lz;
+            trailing = tz;
+            int length = 64 - lz - tz;
+            bits.put(3, 2);
+            bits.put(lz, 5);
+            bits.put(length - 1, 6);
+            bits.put(x >> tz, length);
+        }
+    }
+
+    // status codes: runs
+    for (size_t i = 0; i < n;)
+    {
+        size_t j = i + 1;
+        while (j < n && chunk.status[j] == chunk.status[i])
+            j++;
+        put_varint(ss, j - i);
+        put_varint(ss, chunk.status[i]);
+        i = j;
+    }
+
+    e.t_bytes = (uint32_t)ts.size();
+    e.v_bytes = (uint32_t)vs.size();
+    e.s_bytes = (uint32_t)ss.size();
+    e.offset = columns.size;
+    // rows that can't be stored are dropped, the error is printed by append
+    uint8_t* p = columns.append(ts.size() + vs.size() + ss.size());
+    if (p)
+    {
+        memcpy(p, ts.data(), ts.size());
+        memcpy(p + ts.size(), vs.data(), vs.size());
+        memcpy(p + ts.size() + vs.size(), ss.data(), ss.size());
+        if (write(index_fd, &e, sizeof(e)) != sizeof(e))
+            fprintf(stderr, "Error: can't write %s: %s\n", path("dynamic_data.idx").c_str(), strerror(errno));
+        chunks[id].push_back(e);
+        chunks_sealed++;
+    }
+    open_rows -= n;
+    chunk.t.clear();
+    chunk.val.clear();
+    chunk.status.clear();
+}
+
+void mmap_database::commit()
+{
+    if (open_rows > 0)
+        for (auto& c : open)
+            seal(c.first, c.second);
+    if (columns.size <= synced || !columns.data)
+        return;
+    // sealed chunks reach the disk before their index entries, and both before commit returns:
+    // the journal counts the rows stored after it
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t from = synced / page * page;
+    if (msync(columns.data + from, columns.size - from, MS_SYNC) != 0)
+        fprintf(stderr, "Error: can't sync %s: %s\n", path("dynamic_data.col").c_str(), strerror(errno));
+    else if (fdatasync(index_fd) != 0)
+        fprintf(stderr, "Error: can't sync %s: %s\n", path("dynamic_data.idx").c_str(), strerror(errno));
+    else
+        synced = columns.size;
+}
+
+std::vector<chunk_cursor> mmap_database::scan(int id, int64_t from, int64_t to) const
+{
+    std::vector<chunk_cursor> result;
+    auto it = chunks.find(id);
+    if (it == chunks.end())
+        return result;
+    for (auto& e : it->second)
+        if (e.last_t >= from && e.first_t <= to)
+            result.emplace_back(columns.data, e);
+    return result;
+}
+
+void mmap_database::read(int id, int64_t from, int64_t to, dynamic_rows& rows) const
+{
+    int64_t t;
+    double val;
+    uint32_t status;
+    for (auto& cursor : scan(id, from, to))
+        while (cursor.next(t, val, status))
+            if (t >= from && t <= to)
+            {
+                rows.id.push_back(id);
+                rows.t.push_back(t);
+                rows.val.push_back(val);
+                rows.status.push_back(status);
+            }
+    auto it = open.find(id);
+    if (it == open.end())
+        return;
+    const open_chunk& chunk = it->second;
+    for (size_t i = 0; i < chunk.t.size(); i++)
+        if (chunk.t[i] >= from && chunk.t[i] <= to)
+        {
+            rows.id.push_back(id);
+            rows.t.push_back(chunk.t[i]);
+            rows.val.push_back(chunk.val[i]);
+            rows.status.push_back(chunk.status[i]);
+        }
+}
+
+std::vector<int64_t> mmap_database::stored_times(int id, int64_t from, int64_t to)
+{
+    dynamic_rows rows;
+    read(id, from, to, rows);
+    std::sort(rows.t.begin(), rows.t.end());
+    return rows.t;
+}
+
+tag_ranges mmap_database::time_ranges()
+{
+    tag_ranges result;
+    auto add = [&result](int id, int64_t first, int64_t last) {
+        auto r = result.emplace(id, std::make_pair(first, last));
+        if (!r.second)
+        {
+            r.first->second.first = std::min(r.first->second.first, first);
+            r.first->second.second = std::max(r.first->second.second, last);
+        }
+    };
+    for (auto& c : chunks)
+        for (auto& e : c.second)
+            add(c.first, e.first_t, e.last_t);
+    for (auto& c : open)
+        if (!c.second.t.empty())
+            add(c.first, *std::min_element(c.second.t.begin(), c.second.t.end()),
+                *std::max_element(c.second.t.begin(), c.second.t.end()));
+    return result;
+}
+
+void mmap_database::finalize_db()
+{
+    commit();
+    double seconds = std::chrono::duration<double>(insert_time).count();
+    printf("%s insert: %llu rows in %.3f s, %.0f rows/s, %llu chunks, %zu bytes in dynamic_data.col\n",
+           dir.c_str(), (unsigned long long)rows_inserted, seconds, seconds > 0 ? rows_inserted / seconds : 0.0,
+           (unsigned long long)chunks_sealed, columns.size);
+    if (ingest_dedup)
+        printf("%llu rows already stored dropped\n", (unsigned long long)rows_dropped);
+    // tags with overlapping chunks (history read twice, backfills) are sorted and deduplicated into new chunks,
+    // the old ones stay in dynamic_data.col as unused bytes
+    size_t rewritten = 0;
+    for (auto& c : chunks)
+    {
+        std::vector<chunk_entry>& entries = c.second;
+        bool overlap = false;
+        for (size_t i = 1; i < entries.size() && !overlap; i++)
+            overlap = entries[i].first_t <= entries[i - 1].last_t;
+        if (!overlap)
+            continue;
+        dynamic_rows rows;
+        read(c.first, INT64_MIN, INT64_MAX, rows);
+        std::vector<size_t> order(rows.size());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&rows](size_t a, size_t b) {return rows.t[a] < rows.t[b];});
+        entries.clear();
+        open_chunk& chunk = open[c.first];
+        for (size_t k = 0; k < order.size(); k++)
+        {
+            size_t i = order[k];
+            if (k > 0)
+            {
+                size_t p = order[k - 1];
+                if (rows.t[p] == rows.t[i] && rows.status[p] == rows.status[i] &&
+                        double_bits(rows.val[p]) == double_bits(rows.val[i]))
+                    continue;
+            }
+            chunk.t.push_back(rows.t[i]);
+            chunk.val.push_back(rows.val[i]);
+            chunk.status.push_back((uint32_t)rows.status[i]);
+            open_rows++;
+            if (chunk.t.size() >= chunk_rows)
+                seal(c.first, chunk);
+        }
+        seal(c.first, chunk);
+        rewritten++;
+    }
+    if (rewritten > 0)
+    {
+        // index of the chunks in use only
+        std::string index = path("dynamic_data.idx");
+        int fd = ::open((index + ".tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            fprintf(stderr, "Error: can't create %s.tmp: %s\n", index.c_str(), strerror(errno));
+            return;
+        }
+        for (auto& c : chunks)
+            if (write(fd, c.second.data(), c.second.size() * sizeof(chunk_entry)) !=
+                    (ssize_t)(c.second.size() * sizeof(chunk_entry)))
+                fprintf(stderr, "Error: can't write %s.tmp: %s\n", index.c_str(), strerror(errno));
+        fsync(fd);
+        close(fd);
+        rename((index + ".tmp").c_str(), index.c_str());
+        close(index_fd);
+        index_fd = ::open(index.c_str(), O_WRONLY | O_APPEND);
+        printf("%zu tags with overlapping chunks sorted and deduplicated\n", rewritten);
+    }
+    if (columns.data)
+        msync(columns.data, columns.size, MS_SYNC);
+    fsync(index_fd);
+    synced = columns.size;
+}
@@ -0,0 +1,132 @@
+#ifndef MMAPDATABASE_H
+#define MMAPDATABASE_H
+
+#include "sampleclient.h"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// one sealed chunk: up to chunk_rows values of one tag, stored as three columns one after another:
+// timestamps (first_t, then zigzag varint delta-of-delta), values (Gorilla XOR bit stream)
+// and status codes (varint run length, code pairs)
+struct chunk_entry
+{
+    int32_t id;
+    uint32_t count;
+    int64_t first_t;    // min and max t of the chunk, ms since epoch
+    int64_t last_t;
+    uint64_t offset;    // in dynamic_data.col
+    uint32_t t_bytes;
+    uint32_t v_bytes;
+    uint32_t s_bytes;
+    uint32_t reserved;
+    uint64_t end() const {return offset + t_bytes + v_bytes + s_bytes;}
+};
+
+// rows of one chunk decoded straight from the mapped file, in the order they were written
+class chunk_cursor
+{
+public:
+    chunk_cursor(const uint8_t* data, const chunk_entry&);
+    bool next(int64_t& t, double& val, uint32_t& status);
+
+private:
+    uint64_t bits(int n);
+
+    const uint8_t* ts;
+    const uint8_t* vs;
+    const uint8_t* ss;
+    uint32_t left;
+    bool first = true;
+    int64_t t = 0;
+    int64_t delta = 0;
+    uint64_t value = 0;
+    size_t bit = 0;
+    int leading = 0;
+    int trailing = 0;
+    uint64_t run = 0;
+    uint32_t code = 0;
+};
+
+// local time-series store in a directory (-f data.tsdb):
+//   dynamic_data.col  - chunks of all tags, appended through a shared memory mapping
+//   dynamic_data.idx  - chunk_entry of every chunk, written after the chunk itself
+//   static_data.csv   - id,name of the tags
+//   synchro_data.col  - online slices: int64 t and one double per tag, synchro_data.csv - tag names
+// Rows of a tag are collected in memory and sealed into a chunk when chunk_rows are there
+// or on commit(). A range scan of a tag touches only the chunks the index points to.
+class mmap_database : public database
+{
+public:
+    mmap_database(bool, const char*);
+    ~mmap_database();
+    void init_db(std::vector<std::string>);
+    // there is no SQL: prints an error
+    int exec(const char*);
+    void init_synchro(std::vector<std::string>);
+    void finalize_db();
+    void load_ids(std::unordered_map<std::string, int>&);
+    std::string now() {return format_time(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                              std::chrono::system_clock::now().time_since_epoch()).count());}
+    std::string timestamp(int64_t ms) {return format_time(ms);}
+    void insert_dynamic(const dynamic_rows&);
+    void insert_slices(const std::vector<slice>&);
+    // open rows or sealed chunks not synced to the disk yet
+    bool uncommitted() const {return open_rows > 0 || columns.size > synced;}
+    // seals every open chunk and syncs the new chunks and their index entries
+    void commit();
+    tag_ranges time_ranges();
+    std::vector<int64_t> stored_times(int, int64_t, int64_t);
+
+    // chunks of the tag with rows in [from, to]; cursors point into the mapping
+    // and are valid until the next insert
+    std::vector<chunk_cursor> scan(int id, int64_t from, int64_t to) const;
+    // rows of the tag in [from, to] appended to rows
+    void read(int id, int64_t from, int64_t to, dynamic_rows& rows) const;
+
+    size_t chunk_rows = 4096;
+
+protected:
+    void store_ids(const std::vector<std::pair<int, std::string>>&);
+
+private:
+    // file grown by ftruncate and remapped, size is the used part
+    struct mapped_file
+    {
+        int fd = -1;
+        uint8_t* data = nullptr;
+        size_t size = 0;
+        size_t capacity = 0;
+        bool open(const std::string& file);
+        uint8_t* append(size_t bytes);
+        void close();
+    };
+    struct open_chunk
+    {
+        std::vector<int64_t> t;
+        std::vector<double> val;
+        std::vector<uint32_t> status;
+    };
+    void open_files();
+    void seal(int id, open_chunk&);
+    std::string path(const char* file) const;
+
+    std::string dir;
+    mapped_file columns;
+    mapped_file synchro;
+    int index_fd = -1;
+    std::unordered_map<int, std::vector<chunk_entry>> chunks;
+    std::unordered_map<int, open_chunk> open;
+    // last t of every tag: when ingest_dedup, rows after it are new without looking into the chunks
+    std::unordered_map<int, int64_t> last_t;
+    size_t open_rows = 0;
+    // bytes of dynamic_data.col known to be on the disk
+    size_t synced = 0;
+    uint64_t rows_inserted = 0;
+    uint64_t rows_dropped = 0;
+    uint64_t chunks_sealed = 0;
+    std::chrono::steady_clock::duration insert_time{0};
+};
+
+#endif // MMAPDATABASE_H
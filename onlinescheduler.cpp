@@ -0,0 +1,97 @@
+#include "onlinescheduler.h"
+#include <thread>
+#include <algorithm>
+
+void duration_histogram::add(std::chrono::microseconds d)
+{
+    int64_t us = d.count() > 0 ? d.count() : 0;
+    int bucket = 0;
+    while (bucket < N_BUCKETS - 1 && (us >> (bucket + 1)) > 0)
+        bucket++;
+    buckets[bucket]++;
+    n++;
+    sum += us;
+    if (us > max)
+        max = us;
+}
+
+// upper bound of the bucket holding the percentile
+int64_t duration_histogram::percentile(double p) const
+{
+    uint64_t rank = (uint64_t)(p * n);
+    uint64_t seen = 0;
+    for (int i = 0; i < N_BUCKETS; i++)
+    {
+        seen += buckets[i];
+        if (seen > rank)
+            return std::min<int64_t>(((int64_t)1 << (i + 1)) - 1, max);
+    }
+    return max;
+}
+
+void duration_histogram::print(FILE* out, const char* name) const
+{
+    if (n == 0)
+    {
+        fprintf(out, "%s: no data\n", name);
+        return;
+    }
+    fprintf(out, "%s: n=%llu mean=%.3f ms p50<=%.3f ms p99<=%.3f ms max=%.3f ms\n", name,
+            (unsigned long long)n, sum / 1000.0 / n, percentile(0.5) / 1000.0, percentile(0.99) / 1000.0, max / 1000.0);
+    for (int i = 0; i < N_BUCKETS; i++)
+    {
+        if (buckets[i])
+            fprintf(out, "  < %10.3f ms: %llu\n", ((int64_t)1 << (i + 1)) / 1000.0, (unsigned long long)buckets[i]);
+    }
+}
+
+online_scheduler::online_scheduler(int delta_ms, overrun_policy p)
+    : delta(delta_ms > 0 ? delta_ms : 1), policy(p)
+{
+    auto now = std::chrono::system_clock::now();
+    // first tick: first multiple of delta after now
+    next_tick = std::chrono::system_clock::time_point(
+                (std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()) / delta + 1) * delta);
+}
+
+std::chrono::system_clock::time_point online_scheduler::wait_next()
+{
+    auto now = std::chrono::system_clock::now();
+    if (now >= next_tick + delta)
+    {
+        // previous cycle overran at least one whole tick
+        if (policy == SKIP)
+        {
+            uint64_t missed = (now - next_tick) / delta;
+            missed_ticks += missed;
+            next_tick += missed * delta;
+        }
+        else
+            missed_ticks++;
+    }
+    std::this_thread::sleep_until(next_tick);
+    auto tick = next_tick;
+    jitter.add(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - tick));
+    next_tick += delta;
+    cycle_start = std::chrono::steady_clock::now();
+    return tick;
+}
+
+void online_scheduler::cycle_done()
+{
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - cycle_start);
+    latency.add(duration);
+    cycles++;
+    if (duration > delta)
+        overruns++;
+}
+
+void online_scheduler::print_stats(FILE* out) const
+{
+    fprintf(out, "\nonline scheduler: delta=%lld ms policy=%s cycles=%llu overruns=%llu missed ticks=%llu (%s)\n",
+            (long long)delta.count(), policy == SKIP ? "skip" : "catch-up",
+            (unsigned long long)cycles, (unsigned long long)overruns, (unsigned long long)missed_ticks,
+            policy == SKIP ? "skipped" : "started late");
+    latency.print(out, "cycle latency");
+    jitter.print(out, "start jitter");
+}
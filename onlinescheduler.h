@@ -0,0 +1,56 @@
+#ifndef ONLINESCHEDULER_H
+#define ONLINESCHEDULER_H
+
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+
+// log2 histogram of durations in microseconds: bucket i counts [2^i, 2^(i+1)) us
+class duration_histogram
+{
+public:
+    void add(std::chrono::microseconds);
+    void print(FILE*, const char* name) const;
+    uint64_t count() const {return n;}
+private:
+    // 2^25 us = 33 s, everything longer goes to the last bucket
+    static const int N_BUCKETS = 26;
+    uint64_t buckets[N_BUCKETS] = {};
+    uint64_t n = 0;
+    int64_t sum = 0;
+    int64_t max = 0;
+    int64_t percentile(double) const;
+};
+
+// online cycles on an absolute wall-clock grid: tick k is at k*delta ms since epoch,
+// so overrunning cycles don't shift the following ones
+class online_scheduler
+{
+public:
+    enum overrun_policy
+    {
+        SKIP,       // missed ticks are dropped, next cycle starts on the next tick of the grid
+        CATCH_UP    // missed ticks are run one after another without sleeping
+    };
+
+    online_scheduler(int delta_ms, overrun_policy);
+
+    // sleeps until the next tick and returns its scheduled time
+    std::chrono::system_clock::time_point wait_next();
+    // end of the cycle started by the last wait_next()
+    void cycle_done();
+    void print_stats(FILE*) const;
+
+private:
+    std::chrono::milliseconds delta;
+    overrun_policy policy;
+    std::chrono::system_clock::time_point next_tick;
+    std::chrono::steady_clock::time_point cycle_start;
+    uint64_t cycles = 0;
+    uint64_t overruns = 0;
+    uint64_t missed_ticks = 0;
+    duration_histogram latency;
+    duration_histogram jitter;
+};
+
+#endif // ONLINESCHEDULER_H
@@ -0,0 +1,94 @@
+#include "requestpacer.h"
+#include "uabase.h"
+#include <algorithm>
+#include <thread>
+
+request_pacer::request_pacer(int start_ms, int min_ms, int max_ms)
+    : min_delay(std::max(min_ms, 0)), max_delay(std::max(max_ms, std::max(min_ms, 0)))
+{
+    delay = std::min(std::max((double)start_ms, min_delay), max_delay);
+}
+
+std::chrono::steady_clock::duration request_pacer::wait()
+{
+    auto start = std::chrono::steady_clock::now();
+    int ms = delay_ms();
+    if (ms > 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    return std::chrono::steady_clock::now() - start;
+}
+
+bool request_pacer::is_push_back(uint32_t status)
+{
+    switch (status)
+    {
+    case OpcUa_BadTimeout:
+    case OpcUa_BadTooManyOperations:
+    case OpcUa_BadServerTooBusy:
+    case OpcUa_BadResourceUnavailable:
+    case OpcUa_BadNoContinuationPoints:
+    case OpcUa_BadCommunicationError:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool request_pacer::is_transient(uint32_t status)
+{
+    switch (status)
+    {
+    case OpcUa_BadNotConnected:
+    case OpcUa_BadConnectionClosed:
+    case OpcUa_BadSessionIdInvalid:
+    case OpcUa_BadRequestTimeout:
+        return true;
+    default:
+        return is_push_back(status);
+    }
+}
+
+void request_pacer::done(std::chrono::steady_clock::duration response, uint32_t status)
+{
+    double ms = std::chrono::duration<double, std::milli>(response).count();
+    std::lock_guard<std::mutex> lock(mutex);
+    requests++;
+    total_delay += delay;
+    bool slow = srtt > 0 && ms > SLOW_RESPONSE * srtt;
+    srtt = srtt > 0 ? srtt + (ms - srtt) / 8 : ms;
+    if (is_push_back(status) || (status & 0x80000000) || slow)
+    {
+        back_off();
+        return;
+    }
+    // delay -> rate in requests/s and back
+    double rate = delay > 0 ? 1000.0 / delay : 0;
+    if (rate > 0)
+        delay = std::max(1000.0 / (rate + ADDITIVE_INCREASE), min_delay);
+}
+
+void request_pacer::push_back()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    back_off();
+}
+
+void request_pacer::back_off()
+{
+    push_backs++;
+    delay = std::min(std::max(delay * 2, 1.0), max_delay);
+}
+
+int request_pacer::delay_ms() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return (int)delay;
+}
+
+void request_pacer::print_stats(FILE* out) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    fprintf(out, "request pacer: %llu requests, %llu push backs, delay now %.0f ms (mean %.0f, bounds %.0f..%.0f), "
+            "smoothed response %.0f ms\n", (unsigned long long)requests, (unsigned long long)push_backs, delay,
+            requests ? total_delay / requests : delay, min_delay, max_delay, srtt);
+}
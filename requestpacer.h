@@ -0,0 +1,49 @@
+#ifndef REQUESTPACER_H
+#define REQUESTPACER_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+
+// delay before history requests, shared by all history sessions (AIMD on the request rate).
+// The delay is per session: each one sleeps it before its own request, so n sessions send up to
+// n requests per delay and the modelled rate is that of one session.
+// Every answered request raises the rate by ADDITIVE_INCREASE requests/s, server push back -
+// a timeout, a Bad status of the service or of a node saying the server is overloaded, or a
+// response much slower than usual - halves it. The delay stays in [min_ms, max_ms].
+class request_pacer
+{
+public:
+    request_pacer(int start_ms, int min_ms, int max_ms);
+
+    // sleeps the current delay, returns the time slept
+    std::chrono::steady_clock::duration wait();
+    // result of one request: its response time and service status
+    void done(std::chrono::steady_clock::duration response, uint32_t status);
+    // push back seen in a node result of an answered request
+    void push_back();
+    int delay_ms() const;
+    void print_stats(FILE*) const;
+
+    static constexpr double ADDITIVE_INCREASE = 0.1;
+    // response slower than this times the smoothed response time is push back
+    static constexpr double SLOW_RESPONSE = 3.0;
+
+    static bool is_push_back(uint32_t status);
+    // push back or a lost connection or session: the request may be repeated later
+    static bool is_transient(uint32_t status);
+
+private:
+    void back_off();
+    double delay;   // ms
+    double min_delay;
+    double max_delay;
+    double srtt = 0; // smoothed response time, ms
+    uint64_t requests = 0;
+    uint64_t push_backs = 0;
+    double total_delay = 0;
+    mutable std::mutex mutex;
+};
+
+#endif // REQUESTPACER_H
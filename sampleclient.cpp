@@ -24,6 +24,11 @@
 **
 ******************************************************************************/
 #include "sampleclient.h"
+#include "historypipeline.h"
+#include "requestpacer.h"
+#include "sessionrecycler.h"
+#include "mmapdatabase.h"
+#include "arrowdatabase.h"
 #include "uasession.h"
 #include "samplesubscription.h"
 #include "uasettings.h"
@@ -38,6 +43,10 @@
 #include <fstream>
 #include <string.h>
 #include <signal.h>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <memory>
 volatile static bool exit_flag = false;
 volatile static bool browse_internal = false;
 
@@ -58,6 +67,7 @@ SampleClient::SampleClient(int d, int m, int n = 1, bool r=false, bool b=false,
     m_pSession = new UaSession();
     m_pSampleSubscription = NULL;
     db = nullptr;
+    writer = nullptr;
     delta = d;
     mean = m;
     ns = n;
@@ -83,7 +93,23 @@ SampleClient::SampleClient(int d, int m, int n = 1, bool r=false, bool b=false,
     else if (f != "")
     {
         //
-        if (f.substr(f.size() - 6) == "sqlite")
+        std::string ext = f.substr(f.find_last_of('.') == std::string::npos ? f.size() : f.find_last_of('.'));
+        if (ext == ".arrow" || ext == ".feather" || ext == ".arrows" || ext == ".parquet")
+        {
+#ifdef WITH_ARROW
+            printf("using local %s file\n",f.c_str());
+            db = new arrow_database(r,f.c_str());
+#else
+            fprintf(stderr, "Error: %s: the client is built without Apache Arrow (WITH_ARROW)\n", f.c_str());
+            exit(1);
+#endif
+        }
+        else if (f.size() > 5 && f.substr(f.size() - 5) == ".tsdb")
+        {
+            printf("using local %s column store\n",f.c_str());
+            db = new mmap_database(r,f.c_str());
+        }
+        else if (f.substr(f.size() - 6) == "sqlite")
         {
             printf("using local %s database\n",f.c_str());
             db = new sqlite_database(r,f.c_str());
@@ -91,8 +117,8 @@ SampleClient::SampleClient(int d, int m, int n = 1, bool r=false, bool b=false,
         else
         {
             printf("using local %s csv file\n", f.c_str());
-            csv_fstream.open(f);
-            csv_fstream<<"id, timestamp, value, code\n";
+            if (csv_out.open(f))
+                csv_out.write("id, timestamp, value, code\n");
         }
 
     }
@@ -116,18 +142,91 @@ SampleClient::~SampleClient()
 //        m_pSession = NULL;
     }
 
+    // writer stores queued slices before the database is closed
+    delete writer;
+
     if (db != nullptr)
     {
         std::cout<<"Close DB\n";
         delete db;
         std::cout<<"DB Closed\n";
     }
-    if  (csv_fstream.is_open())
+    csv_out.close();
+}
+
+int64_t to_unix_ms(const OpcUa_DateTime& dt)
+{
+    // OPC UA DateTime: 100 ns ticks since 1601-01-01
+    int64_t ticks = ((int64_t)dt.dwHighDateTime << 32) | dt.dwLowDateTime;
+    return (ticks - 116444736000000000LL) / 10000;
+}
+
+bool to_double(const OpcUa_Variant& v, double& value)
+{
+    if (v.ArrayType != OpcUa_VariantArrayType_Scalar)
+        return false;
+    switch (v.Datatype)
     {
-        csv_fstream.close();
+    case OpcUaType_Boolean: value = v.Value.Boolean ? 1 : 0; return true;
+    case OpcUaType_SByte:   value = v.Value.SByte; return true;
+    case OpcUaType_Byte:    value = v.Value.Byte; return true;
+    case OpcUaType_Int16:   value = v.Value.Int16; return true;
+    case OpcUaType_UInt16:  value = v.Value.UInt16; return true;
+    case OpcUaType_Int32:   value = v.Value.Int32; return true;
+    case OpcUaType_UInt32:  value = v.Value.UInt32; return true;
+    case OpcUaType_Int64:   value = (double)v.Value.Int64; return true;
+    case OpcUaType_UInt64:  value = (double)v.Value.UInt64; return true;
+    case OpcUaType_Float:   value = v.Value.Float; return true;
+    case OpcUaType_Double:  value = v.Value.Double; return true;
+    // numeric tags of some servers have String values, parsing them is the slow path
+    case OpcUaType_String:  return UaVariant(v).toDouble(value) == OpcUa_Good;
+    default: return false;
     }
 }
 
+// bounding values are returned for both edges of a window, only the ones at the edges of the
+// whole range are kept: values before from or at/after to and missing bounds at from are dropped
+static void drop_inner_bounds(UaDataValues& values, int64_t from, int64_t to)
+{
+    OpcUa_UInt32 length = values.length();
+    OpcUa_DataValue* v = values.detach();
+    OpcUa_UInt32 kept = 0;
+    for (OpcUa_UInt32 i = 0; i < length; i++)
+    {
+        int64_t t = to_unix_ms(v[i].SourceTimestamp);
+        if (t < from || t >= to || (t == from && v[i].StatusCode == OpcUa_BadBoundNotFound))
+            OpcUa_DataValue_Clear(&v[i]);
+        else
+            v[kept++] = v[i];
+    }
+    values.attach(kept, v);
+}
+
+OpcUa_DateTime from_unix_ms(int64_t ms)
+{
+    OpcUa_DateTime dt;
+    int64_t ticks = ms * 10000 + 116444736000000000LL;
+    dt.dwHighDateTime = (OpcUa_UInt32)(ticks >> 32);
+    dt.dwLowDateTime = (OpcUa_UInt32)(ticks & 0xFFFFFFFF);
+    return dt;
+}
+
+void format_time(int64_t ms, char* buffer)
+{
+    time_t seconds = ms / 1000;
+    struct tm t;
+    gmtime_r(&seconds, &t);
+    snprintf(buffer, 24, "%04d-%02d-%02d %02d:%02d:%02d.%03d", t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
+             t.tm_hour, t.tm_min, t.tm_sec, (int)(ms % 1000));
+}
+
+std::string format_time(int64_t ms)
+{
+    char buffer[24];
+    format_time(ms, buffer);
+    return buffer;
+}
+
 static int callback(void *NotUsed, int argc, char **argv, char **azColName) {
    int i;
    for(i = 0; i<argc; i++) {
@@ -137,17 +236,26 @@ static int callback(void *NotUsed, int argc, char **argv, char **azColName) {
    return 0;
 }
 
-void SampleClient::init_db()
+void SampleClient::configure_db()
 {
-    std::fstream infile(kks_file.c_str());
-    std::string kks;
-
-    while (infile >> kks)
+    if (sqlite_database* sq = dynamic_cast<sqlite_database*>(db))
     {
-        kks_array.push_back(kks);
-        slice_data[kks] = std::vector<double>();
+        sq->bulk = sqlite_bulk;
+        sq->synchronous = sqlite_synchronous;
+        sq->transaction_rows = sqlite_transaction_rows;
     }
-    db->init_db(kks_array);
+#ifdef WITH_ARROW
+    if (arrow_database* ar = dynamic_cast<arrow_database*>(db))
+        ar->row_group = arrow_row_group > 0 ? arrow_row_group : 1;
+#endif
+    db->ingest_dedup = dedup;
+}
+
+void SampleClient::init_db()
+{
+    configure_db();
+    tags.load(kks_file, ns);
+    db->init_db(tags.names());
 }
 
 void SampleClient::connectionStatusChanged(
@@ -176,6 +284,8 @@ void SampleClient::connectionStatusChanged(
         break;
     case UaClient::NewSessionCreated:
         fprintf(stderr, "Error: Connection status changed to NewSessionCreated\n");
+        // registered node ids died with the old session
+        registration_lost = true;
         break;
     }
 //    printf("-------------------------------------------------------------\n");
@@ -183,7 +293,6 @@ void SampleClient::connectionStatusChanged(
 
 UaStatus SampleClient::connect(std::string server_opt)
 {
-    UaStatus result;
     if (server_opt != "")
         url = server_opt;
     else{
@@ -191,7 +300,13 @@ UaStatus SampleClient::connect(std::string server_opt)
         std::fstream infile("server.conf");
         infile >> url;
     }
+    return connect_session(m_pSession);
+}
 
+UaStatus SampleClient::connect_session(UaSession* session)
+{
+    UaStatus result;
+    auto start = std::chrono::steady_clock::now();
     UaString sURL(url.c_str());
 
     // Provide information about the client
@@ -207,12 +322,14 @@ UaStatus SampleClient::connect(std::string server_opt)
     sessionConnectInfo.sApplicationUri  = UaString("urn:%1:UnifiedAutomation:GettingStartedClient").arg(sNodeName);
     sessionConnectInfo.sProductUri      = "urn:UnifiedAutomation:GettingStartedClient";
     sessionConnectInfo.sSessionName     = sessionConnectInfo.sApplicationUri;
+    // the SDK reads the server state every nWatchdogTime ms and reports a lost connection
+    sessionConnectInfo.nWatchdogTime    = watchdog_ms;
 
     // Security settings are not initialized - we connect without security for now
     SessionSecurityInfo sessionSecurityInfo;
 
 //    printf("\nConnecting to %s\n", sURL.toUtf8());
-    result = m_pSession->connect(
+    result = session->connect(
         sURL,
         sessionConnectInfo,
         sessionSecurityInfo,
@@ -226,6 +343,8 @@ UaStatus SampleClient::connect(std::string server_opt)
     {
         fprintf(stderr, "Error: Connect failed with status %s\n", result.toString().toUtf8());
     }
+    connects++;
+    connect_us += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
 
 //    std::cout<<"m_pSession->getEndpointUrl().toUtf8() "<<m_pSession->getEndpointUrl().toUtf8();
 //    std::cout<<"m_pSession->getServerProductUri().toUtf8() "<<m_pSession->getServerProductUri().toUtf8();
@@ -236,16 +355,23 @@ UaStatus SampleClient::connect(std::string server_opt)
 }
 
 UaStatus SampleClient::disconnect()
+{
+    UaStatus result = disconnect_session(m_pSession);
+    tags.clear_registered();
+    return result;
+}
+
+UaStatus SampleClient::disconnect_session(UaSession* session)
 {
 
-    if (m_pSession->isConnected() == OpcUa_False)
+    if (session->isConnected() == OpcUa_False)
         return UaStatus(OpcUa_Good);
     else {
         UaStatus result;
         // Default settings like timeout
         ServiceSettings serviceSettings;
         printf("\nDisconnecting ...\n");
-        result = m_pSession->disconnect(
+        result = session->disconnect(
             serviceSettings,
             OpcUa_True);
 
@@ -271,54 +397,109 @@ UaStatus SampleClient::reconnect(int p)
          disconnect();
     UaThread::msleep(p);
     UaStatus result = connect(url);
+    if (result.isGood() && register_nodes && tags.size())
+        register_tags();
     return result;
 
 }
 
+UaStatus SampleClient::reconnect_session(UaSession* session, int p)
+{
+    disconnect_session(session);
+    UaThread::msleep(p);
+    return connect_session(session);
+}
+
+// closes and opens the session of a history worker, worker 0 also registers its nodes again
+UaStatus SampleClient::recycle_session(int worker, UaSession* session, int p)
+{
+    auto start = std::chrono::steady_clock::now();
+    UaStatus result = worker == 0 ? reconnect(p) : reconnect_session(session, p);
+    recycles++;
+    recycle_us += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+void SampleClient::print_session_stats(FILE* out) const
+{
+    fprintf(out, "sessions: %llu connects in %.1f s, %llu recycled in %.1f s (with disconnect and wait)\n",
+            (unsigned long long)connects.load(), connect_us / 1e6,
+            (unsigned long long)recycles.load(), recycle_us / 1e6);
+}
+
 void SampleClient::online_db_init()
 {
-    std::fstream infile(kks_file.c_str());
-    std::string kks;
+    synchro_init();
 
-    while (infile >> kks)
+    if (max_nodes_per_read == 0)
     {
-        kks_array.push_back(kks);
+        UaStatus result = read_operation_limit(OpcUaId_Server_ServerCapabilities_OperationLimits_MaxNodesPerRead, max_nodes_per_read);
+        if (result.isNotGood())
+            fprintf(stderr, "Error: can't read MaxNodesPerRead, status %s\n", result.toString().toUtf8());
     }
-    for (auto k : kks_array)
+    printf("max nodes per read = %u (0 - unlimited)\n", max_nodes_per_read);
+    // node ids are copied once, the same requests are sent every cycle
+    tags.build_read_requests(online_requests, max_nodes_per_read);
+    if (register_nodes)
+        register_tags();
+}
+
+// tags, synchro_data table (or csv header) and the slice writer, shared by online and processed history modes
+void SampleClient::synchro_init()
+{
+    tags.load(kks_file, ns);
+    for (auto k : tags.names())
     {
         kks_string += "\"" + k + "\",";
     }
     std::cout<<"KKS STRING:" << kks_string << "\n";
+    slice_data.resize(tags.size());
 
     if (db)
     {
-        db->init_synchro(kks_array);
+        configure_db();
+        db->init_synchro(tags.names());
     }
     else
-        csv_fstream<<kks_string<<"\n";
+        csv_out.write(kks_string + "\n");
+    writer = new slice_writer(db, &csv_out, writer_queue, writer_batch, writer_flush_ms, writer_overflow, spill_file);
+}
+
+void SampleClient::register_tags()
+{
+    OpcUa_UInt32 max_nodes_per_register = 0;
+    registration_lost = false;
+    read_operation_limit(OpcUaId_Server_ServerCapabilities_OperationLimits_MaxNodesPerRegisterNodes, max_nodes_per_register);
+    tags.register_nodes(m_pSession, max_nodes_per_register);
+    // requests keep copies of node ids
+    if (!online_requests.empty())
+        tags.build_read_requests(online_requests, max_nodes_per_read);
+}
+
+void SampleClient::print_online_stats(FILE* out) const
+{
+    if (writer)
+        writer->print_stats(out);
 }
 
 UaStatus SampleClient::read_once()
 {
     UaStatus          result;
     ServiceSettings   serviceSettings;
-    UaReadValueIds    nodeToRead;
-    nodeToRead.create(1);
     UaDataValues      values;
     UaDiagnosticInfos diagnosticInfos;
-    int item_index = 0;
+    OpcUa_UInt32      offset = 0;
 
+    if (tags.size() == 0)
+    {
+        tags.load(kks_file, ns);
+        tags.build_read_requests(online_requests, max_nodes_per_read);
+        if (register_nodes)
+            register_tags();
+    }
 
-
-    std::fstream infile(kks_file.c_str());
-    std::string kks;
-
-    while (infile >> kks)
+    for (const auto& nodeToRead : online_requests)
     {
-        nodeToRead.resize(item_index+1);
-        nodeToRead[item_index].AttributeId = OpcUa_Attributes_Value;
-        UaNodeId test(UaString(kks.c_str()),ns);
-        test.copyTo(&nodeToRead[item_index].NodeId);
         result = m_pSession->read(
             serviceSettings,
             0,
@@ -329,18 +510,21 @@ UaStatus SampleClient::read_once()
 
         if (result.isGood())
         {
-                    UaVariant tempValue = values[0].Value;
-                    unsigned int timeValueHigh = values[0].SourceTimestamp.dwHighDateTime;
-                    unsigned int timeValueLow = values[0].SourceTimestamp.dwLowDateTime;
+            for (OpcUa_UInt32 i = 0; i < values.length(); i++)
+            {
+                    UaVariant tempValue = values[i].Value;
+                    unsigned int timeValueHigh = values[i].SourceTimestamp.dwHighDateTime;
+                    unsigned int timeValueLow = values[i].SourceTimestamp.dwLowDateTime;
                     OpcUa_Double val;
-                    std::string value_str = UaVariant(tempValue).toString().toUtf8();
-                    if (value_str == "true") val = 1;
-                    if (value_str == "false") val = 0;
-                    else tempValue.toDouble(val);
+                    if (values[i].Value.Datatype == OpcUaType_Boolean)
+                        val = values[i].Value.Value.Boolean ? 1 : 0;
+                    else
+                        tempValue.toDouble(val);
 
                     double value = val;
-                    std::cout<<  "id: " << kks <<" , source timestamp: " <<timeValueHigh << " " << timeValueLow << ", val: " << value << "\n";
-
+                    std::cout<<  "id: " << tags.name(offset + i) <<" , source timestamp: " <<timeValueHigh << " " << timeValueLow << ", val: " << value << "\n";
+            }
+            offset += nodeToRead.length();
         }
         else
         {
@@ -351,91 +535,194 @@ UaStatus SampleClient::read_once()
     return result;
 }
 
-UaStatus SampleClient::read_online()
+UaStatus SampleClient::read_operation_limit(OpcUa_UInt32 limit_id, OpcUa_UInt32& limit)
 {
-    static int iteration_count;
     UaStatus          result;
     ServiceSettings   serviceSettings;
     UaReadValueIds    nodeToRead;
     nodeToRead.create(1);
     UaDataValues      values;
     UaDiagnosticInfos diagnosticInfos;
-    int item_index = 0;
 
+    nodeToRead[0].AttributeId = OpcUa_Attributes_Value;
+    UaNodeId(limit_id).copyTo(&nodeToRead[0].NodeId);
+    result = m_pSession->read(
+        serviceSettings,
+        0,
+        OpcUa_TimestampsToReturn_Neither,
+        nodeToRead,
+        values,
+        diagnosticInfos);
+    if (result.isGood() && values.length() == 1 && OpcUa_IsGood(values[0].StatusCode))
+        result = UaVariant(values[0].Value).toUInt32(limit);
+    else if (result.isGood())
+        result = values.length() == 1 ? values[0].StatusCode : OpcUa_BadInternalError;
+    return result;
+}
 
+void SampleClient::add_online_values(OpcUa_UInt32 offset, const UaDataValues& values)
+{
+    for (OpcUa_UInt32 i = 0; i < values.length(); i++)
+    {
+        const std::string& kks = tags.name(offset + i);
+        // Read service succeded - check status of read value
+        if (read_bad || OpcUa_IsGood(values[i].StatusCode))
+        {
+            OpcUa_Double value;
+            if (!to_double(values[i].Value, value))
+                continue;
+            slice_data.add(offset + i, value);
+            printf("%s : %f\n", kks.c_str(), value);
+        }
+        else
+        {
+            fprintf(stderr, "Error: Read failed for %s with status %s\n", kks.c_str(), UaStatus(values[i].StatusCode).toString().toUtf8());
+        }
+    }
+}
 
+UaStatus SampleClient::read_online_sync(int& n_requests)
+{
+    UaStatus          result;
+    ServiceSettings   serviceSettings;
+    UaDataValues      values;
+    UaDiagnosticInfos diagnosticInfos;
+    OpcUa_UInt32      offset = 0;
 
-    for (auto kks : kks_array)
+    // one Read call per MaxNodesPerRead tags, results are matched to tags by index
+    for (const auto& nodeToRead : online_requests)
     {
+        OpcUa_UInt32 count = nodeToRead.length();
+        result = m_pSession->read(
+            serviceSettings,
+            0,
+            OpcUa_TimestampsToReturn_Both,
+            nodeToRead,
+            values,
+            diagnosticInfos);
+        n_requests++;
 
-        // Configure one node to read
-    	// We read the value of the ServerStatus -> CurrentTime
-    	nodeToRead.resize(item_index+1);
-    	nodeToRead[item_index].AttributeId = OpcUa_Attributes_Value;
-    	UaNodeId test(UaString(kks.c_str()),ns);
-    	test.copyTo(&nodeToRead[item_index].NodeId);
-    	result = m_pSession->read(
-        	serviceSettings,
-        	0,
-        	OpcUa_TimestampsToReturn_Both,
-        	nodeToRead,
-        	values,
-        	diagnosticInfos);
-
-    	if (result.isGood())
-    	{
-        	// Read service succeded - check status of read value
-            if (read_bad || OpcUa_IsGood(values[0].StatusCode))
-        	{
-                    UaVariant tempValue = values[0].Value;
-                    OpcUa_Double val;
-                    tempValue.toDouble(val);
-                    double value = val;
-                    slice_data[kks].push_back(value);
-                    printf("%s : %f\n", UaNodeId(nodeToRead[item_index].NodeId).toXmlString().toUtf8(), value);
+        if (result.isGood() && values.length() == count)
+            add_online_values(offset, values);
+        else
+        {
+            // Service call failed
+            if (result.isGood())
+                result = OpcUa_BadInternalError;
+            fprintf(stderr, "Error: Read failed with status %s\n", result.toString().toUtf8());
+            break;
+        }
+        offset += count;
+    }
+    return result;
+}
 
+UaStatus SampleClient::read_online_async(int& n_requests)
+{
+    UaStatus          result;
+    ServiceSettings   serviceSettings;
+    OpcUa_UInt32      offset = 0;
+    // the SDK reports a timed out request through readComplete, wait a bit longer than that
+    auto timeout = std::chrono::milliseconds(2 * serviceSettings.callTimeout);
+
+    std::unique_lock<std::mutex> lock(async_mutex);
+    async_status = OpcUa_Good;
+    for (const auto& nodeToRead : online_requests)
+    {
+        // keep no more than max_in_flight requests on the wire
+        if (!async_cv.wait_for(lock, timeout, [this]{ return async_requests.size() < max_in_flight; }))
+        {
+            result = OpcUa_BadTimeout;
+            break;
+        }
+        OpcUa_UInt32 count = nodeToRead.length();
+        OpcUa_UInt32 transaction = ++async_transaction;
+        async_requests[transaction] = std::make_pair(offset, count);
+        // readComplete may be called before beginRead returns
+        lock.unlock();
+        result = m_pSession->beginRead(
+            serviceSettings,
+            0,
+            OpcUa_TimestampsToReturn_Both,
+            nodeToRead,
+            transaction);
+        lock.lock();
+        if (result.isNotGood())
+        {
+            async_requests.erase(transaction);
+            fprintf(stderr, "Error: BeginRead failed with status %s\n", result.toString().toUtf8());
+            break;
+        }
+        n_requests++;
+        offset += count;
+    }
 
+    // all chunks of the slice have to be in slice_data before it is stored
+    if (!async_cv.wait_for(lock, timeout, [this]{ return async_requests.empty(); }))
+    {
+        fprintf(stderr, "Error: %zu asynchronous reads not completed, results dropped\n", async_requests.size());
+        async_requests.clear();
+        result = OpcUa_BadTimeout;
+    }
+    if (result.isGood())
+        result = async_status;
+    return result;
+}
 
-        	}	
-        	else
-        	{
-                    fprintf(stderr, "Error: Read failed for %s with status %s\n", UaNodeId(nodeToRead[item_index].NodeId).toXmlString().toUtf8(),UaStatus(values[0].StatusCode).toString().toUtf8());
-        	}
-    	}
-   	else
-    	{
-        	// Service call failed
-            fprintf(stderr, "Error: Read failed with status %s\n", result.toString().toUtf8());
-		break;
-    	}
+void SampleClient::readComplete(
+    OpcUa_UInt32             transactionId,
+    const UaStatus&          result,
+    const UaDataValues&      values,
+    const UaDiagnosticInfos& diagnosticInfos)
+{
+    OpcUa_ReferenceParameter(diagnosticInfos);
+
+    std::lock_guard<std::mutex> lock(async_mutex);
+    auto request = async_requests.find(transactionId);
+    if (request == async_requests.end())
+        return; // late answer of a cycle that already timed out
+    if (result.isGood() && values.length() == request->second.second)
+        add_online_values(request->second.first, values);
+    else
+    {
+        fprintf(stderr, "Error: Read failed with status %s\n", result.toString().toUtf8());
+        async_status = result.isGood() ? UaStatus(OpcUa_BadInternalError) : result;
     }
+    async_requests.erase(request);
+    async_cv.notify_all();
+}
+
+UaStatus SampleClient::read_online(std::chrono::system_clock::time_point tick)
+{
+    static int iteration_count;
+    UaStatus result;
+    int      n_requests = 0;
+
+    if (register_nodes && registration_lost)
+        register_tags();
+
+    auto start = std::chrono::steady_clock::now();
+    if (max_in_flight > 0)
+        result = read_online_async(n_requests);
+    else
+        result = read_online_sync(n_requests);
+    auto latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    printf("read %zu tags in %d requests: %.3f ms\n", tags.size(), n_requests, latency.count() / 1000.0);
 
     if (iteration_count == mean-1 )
     {
 
-        std::string value_string;
-        for (auto k : kks_array)
+        slice s;
+        // slice is stamped with the tick of the grid, not with the time of insert
+        s.t = std::chrono::duration_cast<std::chrono::milliseconds>(tick.time_since_epoch()).count();
+        s.values.resize(slice_data.size());
+        for (size_t slot = 0; slot < slice_data.size(); slot++)
         {
-            if (slice_data[k].size())
-            {
-                value_string += std::to_string(std::accumulate(slice_data[k].begin(), slice_data[k].end(), 0.0)/ slice_data[k].size()) + ",";
-                slice_data[k].clear();
-            }
-
-            else
-                value_string += "null,";
+            s.values[slot] = slice_data.count[slot] ? slice_data.mean(slot) : NAN;
         }
-        value_string += db->now();
-
-        std::string sql = std::string("INSERT INTO synchro_data ( ") + kks_string + " timestamp) VALUES(" +
-                value_string + ");";
-        std::cout<< "\n SQL:\n" << sql<< "\n";
-        /* Execute SQL statement */
-        if (db)
-            db->exec(sql.c_str());
-        else
-            csv_fstream<<value_string<<"\n";
-
+        slice_data.reset();
+        // stored by the writer thread, a slow insert doesn't delay the next poll
+        writer->push(std::move(s));
 
         iteration_count = 0;
 
@@ -446,25 +733,26 @@ UaStatus SampleClient::read_online()
     return result;
 }
 
+// without --pause-max the pacer can still slow down from -p, also from -p 0
+static int pause_ceiling(int pause, int pause_max)
+{
+    return pause_max > 0 ? pause_max : std::max(8 * pause, 1000);
+}
+
 UaStatus SampleClient::readHistory(const char* t1, const char* t2, int pause, int timeout, bool read_bounds)
 {
 
     if (db)
         init_db();
+    else
+        tags.load(kks_file, ns);
+    if (register_nodes)
+        register_tags();
 //    return 0;
     //std::ofstream data ("data.csv");
     //data<<"kks;value;timestamp;status\n";
-    UaStatus                      status;
-	ServiceSettings               serviceSettings;
-	serviceSettings.callTimeout = timeout;
 	HistoryReadRawModifiedContext historyReadRawModifiedContext;
 
-
-	UaDiagnosticInfos             diagnosticInfos;
-
-	// Read the last 30 minutes
-	UaDateTime myTime;
-
 	//UaString sStartTime("2020-12-13T00:00:00");
 	UaString sStartTime(t1);//"2021-06-01T00:00:00Z");
 	historyReadRawModifiedContext.startTime = UaDateTime::fromString(sStartTime);
@@ -472,270 +760,541 @@ UaStatus SampleClient::readHistory(const char* t1, const char* t2, int pause, in
 	historyReadRawModifiedContext.endTime = UaDateTime::fromString(sEndTime);;
 	historyReadRawModifiedContext.returnBounds = read_bounds ? OpcUa_True : OpcUa_False;
 	//historyReadRawModifiedContext.numValuesPerNode = 10;
-	// Read four aggregates from one node
 
+    resolve_history_batch();
+    // pause is where the request rate starts
+    request_pacer pacer(pause, pause_min, pause_ceiling(pause, pause_max));
+    if (follow_s > 0)
+        return follow_history(historyReadRawModifiedContext, pacer, timeout);
+
+    if (db && skip_stored)
+        printf("rows already in dynamic_data are skipped\n");
+    int64_t range_begin = to_unix_ms(historyReadRawModifiedContext.startTime);
+    int64_t range_end = to_unix_ms(historyReadRawModifiedContext.endTime);
+    // Arrow and Parquet files are written anew by every run: no journal, its checkpoints would
+    // only make the writer flush small batches
+    std::unique_ptr<history_journal> journal;
+#ifdef WITH_ARROW
+    if (!dynamic_cast<arrow_database*>(db))
+#endif
+        journal.reset(new history_journal(journal_file, range_begin, range_end, resume));
+    std::vector<int64_t> starts(tags.size(), range_begin);
+    for (size_t slot = 0; journal && slot < tags.size(); slot++)
+        starts[slot] = journal->start(tags.name(slot));
+    UaStatus status = read_history_range(historyReadRawModifiedContext, starts, pacer, timeout, journal.get());
+
+    if (db)
+    {
+        printf("\noptimizing db\n");
+        db->finalize_db();
+    }
+    // finalize_db commits the last transaction
+    if (journal)
+        journal->commit();
 
+    return status;
 
-    std::fstream infile(kks_file.c_str());
-    std::ofstream failed_kks("failed_kks.csv");
-    int item_index = 0;
-    std::string kks;
+}
 
-    std::string sql;
-    int id = 0;
-    int N_rows = 0;
-    while (infile >> kks)
+void SampleClient::resolve_history_batch()
+{
+    if (history_batch == 0)
     {
+        UaStatus result = read_operation_limit(OpcUaId_Server_ServerCapabilities_OperationLimits_MaxNodesPerHistoryReadData, history_batch);
+        if (result.isNotGood())
+            fprintf(stderr, "Error: can't read MaxNodesPerHistoryReadData, status %s\n", result.toString().toUtf8());
+        // server has no limit (or didn't tell it)
+        if (history_batch == 0)
+            history_batch = DEFAULT_HISTORY_BATCH;
+    }
+    printf("nodes per history read = %u\n", history_batch);
+}
+
+// reads [starts[slot], end of context) of every tag with all history workers,
+// starts are moved to where each tag is read up to
+UaStatus SampleClient::read_history_range(const HistoryReadRawModifiedContext& historyReadRawModifiedContext,
+                                          std::vector<int64_t>& starts, request_pacer& pacer, int timeout,
+                                          history_journal* journal)
+{
+    int workers = history_workers > 0 ? history_workers : 1;
+    history_progress progress(tags.size(), workers, "failed_kks.csv",
+                              to_unix_ms(historyReadRawModifiedContext.startTime),
+                              to_unix_ms(historyReadRawModifiedContext.endTime),
+                              (int64_t)history_window_s * 1000, history_window_rows, starts);
+    std::vector<UaStatus> status(workers);
+    std::vector<std::thread> threads;
+    history_pipeline pipeline(db, &csv_out, db_mutex, read_bad, history_queue, journal, db && skip_stored);
+    // worker 0 runs on m_pSession in this thread, the others open their own sessions
+    for (int worker = 1; worker < workers; worker++)
+    {
+        threads.emplace_back(&SampleClient::history_worker, this, worker, std::cref(historyReadRawModifiedContext),
+                             std::ref(pacer), timeout, std::ref(progress), std::ref(pipeline), std::ref(status[worker]));
+    }
+    history_worker(0, historyReadRawModifiedContext, pacer, timeout, progress, pipeline, status[0]);
+    for (auto& thread : threads)
+        thread.join();
+    pipeline.close();
+    progress.print(stdout);
+    pipeline.print_stats(stdout, workers);
+    pacer.print_stats(stdout);
+    print_session_stats(stdout);
+    starts = progress.positions();
+    // the first worker that failed to connect or ended with an error
+    for (auto& s : status)
+        if (s.isNotGood())
+        {
+            fprintf(stderr, "Error: history worker ended with status %s\n", s.toString().toUtf8());
+            return s;
+        }
+    return status[0];
+}
+
+// tail mode: every follow_s seconds reads what is new since each tag's high-water mark,
+// up to follow_lag_s seconds before now. Marks come from dynamic_data once, then from
+// the reads themselves, so nothing is read twice and no deduplication is needed
+UaStatus SampleClient::follow_history(HistoryReadRawModifiedContext& historyReadRawModifiedContext,
+                                      request_pacer& pacer, int timeout)
+{
+    UaStatus status;
+    int64_t begin = to_unix_ms(historyReadRawModifiedContext.startTime);
+    std::vector<int64_t> starts(tags.size(), begin);
+    if (db)
+    {
+        tag_ranges stored = db->time_ranges();
+        for (size_t slot = 0; slot < tags.size(); slot++)
+        {
+            auto it = stored.find(db->id(tags.name(slot)));
+            if (it != stored.end())
+                starts[slot] = std::max(begin, it->second.second + 1);
+        }
+        printf("follow: high-water marks of %zu tags in dynamic_data\n", stored.size());
+    }
+    // a bound is not a new value of the tag
+    historyReadRawModifiedContext.returnBounds = OpcUa_False;
+    while (!stop_follow)
+    {
+        int64_t end = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count() - (int64_t)follow_lag_s * 1000;
+        historyReadRawModifiedContext.endTime = UaDateTime(from_unix_ms(end));
+        printf("follow: reading up to %s\n", format_time(end).c_str());
+        UaStatus cycle = read_history_range(historyReadRawModifiedContext, starts, pacer, timeout, nullptr);
+        // tags that were not read keep their marks and are read again next cycle
+        if (cycle.isNotGood())
+        {
+            fprintf(stderr, "Error: follow: reading failed with status %s\n", cycle.toString().toUtf8());
+            if (status.isGood())
+                status = cycle;
+        }
         if (db)
-            id = db->id(kks);
-        else
-            ++id;
-        std::cout<<"\n\nID: "<<id<<"\n\n";
-    	UaHistoryReadValueIds         nodesToRead;
-    	nodesToRead.create(1);
-    	HistoryReadDataResults        results;
-    	//nodesToRead.resize(item_index+1);
-    	//std::string s = "Sochi2.UNIT.AM.";
-    	//std::string q = ".PV";//"-AM.Q";
-    	std::string node_id = kks;//+q;
-    	UaNodeId nodeToRead(UaString(node_id.c_str()),ns);
-    	nodeToRead.copyTo(&nodesToRead[item_index].NodeId);
-
-
-    	/*********************************************************************
-         Update the history of events at an event notifier object
-    	 **********************************************************************/
-    	status = m_pSession->historyReadRawModified(
-    			serviceSettings,
-				historyReadRawModifiedContext,
-				nodesToRead,
-				results,
-				diagnosticInfos);
-    	/*********************************************************************/
-        if ( status.isNotGood() )
-    	{
-            fprintf(stderr, "** Error: %s UaSession::historyReadRawModified failed [ret=%s]\n", kks.c_str(), status.toString().toUtf8());
-//            printf("** id %d Node=%s status=%s \n",id, nodeToRead.toXmlString().toUtf8(), status.toString().toUtf8());
-            failed_kks << kks << " " << status.toString().toUtf8() << "\n";
-    		continue;//return status;
-    	}
-    	else
-    	{
-    		OpcUa_UInt32 i, j;
-    		for ( i=0; i<results.length(); i++ )
-    		{
-                if (results[i].m_dataValues.length() ==0)
+        {
+            std::lock_guard<std::mutex> lock(db_mutex);
+            db->commit();
+        }
+        for (int i = 0; i < follow_s * 10 && !stop_follow; i++)
+            UaThread::msleep(100);
+    }
+    printf("follow: stopped\n");
+    return status;
+}
+
+// server-side aggregates of every tag per processing interval, stored as slices in synchro_data (or csv),
+// the same layout as online mode. Intervals are requested AGGREGATE_CHUNK at a time for history_batch tags
+UaStatus SampleClient::readProcessed(const char* t1, const char* t2, int pause, int timeout)
+{
+    UaStatus status;
+    // first failed request, later good ones do not hide it
+    UaStatus failed;
+    UaDiagnosticInfos diagnosticInfos;
+    synchro_init();
+    if (register_nodes)
+        register_tags();
+    resolve_history_batch();
+    request_pacer pacer(pause, pause_min, pause_ceiling(pause, pause_max));
+    ServiceSettings serviceSettings;
+    serviceSettings.callTimeout = timeout;
+
+    int64_t begin = to_unix_ms(UaDateTime::fromString(UaString(t1)));
+    int64_t end = to_unix_ms(UaDateTime::fromString(UaString(t2)));
+    int64_t interval = (int64_t)(aggregate_interval_s * 1000);
+    if (interval <= 0)
+    {
+        fprintf(stderr, "Error: processing interval must be positive\n");
+        return UaStatus(OpcUa_BadInvalidArgument);
+    }
+    size_t n = tags.size();
+    uint64_t n_values = 0, n_slices = 0, n_failed = 0;
+    // row per interval of the chunk, column per tag; NaN - no good aggregate
+    std::vector<double> matrix;
+    for (int64_t chunk_begin = begin; chunk_begin < end; chunk_begin += interval * AGGREGATE_CHUNK)
+    {
+        int64_t chunk_end = std::min(chunk_begin + interval * AGGREGATE_CHUNK, end);
+        size_t n_intervals = (chunk_end - chunk_begin + interval - 1) / interval;
+        matrix.assign(n_intervals * n, NAN);
+
+        HistoryReadProcessedContext context;
+        context.startTime = UaDateTime(from_unix_ms(chunk_begin));
+        context.endTime = UaDateTime(from_unix_ms(chunk_end));
+        context.processingInterval = (OpcUa_Double)interval;
+        context.aggregateConfiguration.UseServerCapabilitiesDefaults = OpcUa_True;
+        printf("aggregates %s .. %s\n", format_time(chunk_begin).c_str(), format_time(chunk_end).c_str());
+
+        bool chunk_failed = false;
+        for (size_t first = 0; first < n && !chunk_failed; first += history_batch)
+        {
+            // slots of the nodes still having data on the server, request i is for active[i]
+            std::vector<size_t> active(std::min<size_t>(history_batch, n - first));
+            std::iota(active.begin(), active.end(), first);
+            UaHistoryReadValueIds nodesToRead;
+            HistoryReadDataResults results;
+            nodesToRead.create(active.size());
+            for (size_t i = 0; i < active.size(); i++)
+                OpcUa_NodeId_CopyTo(&tags.node(active[i]), &nodesToRead[i].NodeId);
+            bool first_page = true;
+            while (!active.empty())
+            {
+                // one aggregate per node to read
+                context.aggregateTypes.clear();
+                context.aggregateTypes.create(active.size());
+                for (size_t i = 0; i < active.size(); i++)
+                    UaNodeId(aggregate).copyTo(&context.aggregateTypes[i]);
+
+                pacer.wait();
+                auto requested = std::chrono::steady_clock::now();
+                status = m_pSession->historyReadProcessed(serviceSettings, context, nodesToRead, results, diagnosticInfos);
+                pacer.done(std::chrono::steady_clock::now() - requested, status.statusCode());
+                if (status.isNotGood())
                 {
-                    printf("** id %d Node=%s status=empty_data_warning\n",id, nodeToRead.toXmlString().toUtf8());
+                    fprintf(stderr, "** Error: UaSession::historyReadProcessed%s failed [ret=%s]\n",
+                            first_page ? "" : " with CP", status.toString().toUtf8());
+                    if (failed.isGood())
+                        failed = status;
+                    chunk_failed = true;
+                    // the server may still hold the points sent with the failed request
+                    if (!first_page)
+                    {
+                        HistoryReadProcessedContext releaseContext = context;
+                        releaseContext.bReleaseContinuationPoints = OpcUa_True;
+                        UaStatus released = m_pSession->historyReadProcessed(serviceSettings, releaseContext, nodesToRead,
+                                                                             results, diagnosticInfos);
+                        if (released.isNotGood())
+                            fprintf(stderr, "Error: releasing %u continuation points failed [ret=%s]\n",
+                                    nodesToRead.length(), released.toString().toUtf8());
+                    }
                     break;
                 }
-                std::string first_value = (UaVariant(results[i].m_dataValues[0].Value).toString().toUtf8());
-                if (first_value.find_first_not_of("0123456789.,-Ee") != std::string::npos &&
-                        first_value != "true" && first_value != "false")
-                {
-                    failed_kks << kks << " text field \n";
-                    printf("** id %d Node=%s status=text_field_warning \n",id, nodeToRead.toXmlString().toUtf8());
-                    break;
 
-                }
-    			UaStatus nodeResult(results[i].m_status);
-                printf("** id %d Results %d Node=%s status=%s  length=%d\n",id, i, nodeToRead.toXmlString().toUtf8(), nodeResult.toString().toUtf8(), results[i].m_dataValues.length());
-                N_rows += results[i].m_dataValues.length();
-                if ( nodeResult.isNotGood() )
+                std::vector<std::pair<size_t,OpcUa_UInt32>> next;
+                for (OpcUa_UInt32 i = 0; i < results.length() && i < active.size(); i++)
                 {
-                    failed_kks << kks << " " << status.toString().toUtf8() << "\n";
-                }
-                sql = std::string("INSERT INTO dynamic_data (id,t,val,status) VALUES ");
-                bool not_empty = false;
-    			for ( j=0; j<results[i].m_dataValues.length(); j++ )
-    			{
-    				UaStatus statusOPLevel(results[i].m_dataValues[j].StatusCode);
-    				std::string sourceTS = UaDateTime(results[i].m_dataValues[j].SourceTimestamp).toString().toUtf8();
-    				sourceTS.pop_back();
-    				sourceTS[10] = ' ';
-                    if ( read_bad || OpcUa_IsGood(results[i].m_dataValues[j].StatusCode) )
-    				{
-                        not_empty = true;
-                        std::string value = UaVariant(results[i].m_dataValues[j].Value).toString().toUtf8();
-                        if (!db) // using local csv file
-                            csv_fstream<<kks<<","<<sourceTS.c_str()<<"," <<
-                                         value << ",\'" <<
-                                         statusOPLevel.toString().toUtf8()<<"'\n";
-                        else
+                    size_t slot = active[i];
+                    UaStatus nodeResult(results[i].m_status);
+                    if (nodeResult.isNotGood())
+                        fprintf(stderr, "** Error: %s aggregate status %s\n", tags.name(slot).c_str(), nodeResult.toString().toUtf8());
+                    const UaDataValues& values = results[i].m_dataValues;
+                    for (OpcUa_UInt32 j = 0; j < values.length(); j++)
+                    {
+                        if ( !read_bad && !OpcUa_IsGood(values[j].StatusCode) )
+                            continue;
+                        // aggregate is stamped with the start of its interval
+                        int64_t row = (to_unix_ms(values[j].SourceTimestamp) - chunk_begin) / interval;
+                        double value;
+                        if (row >= 0 && row < (int64_t)n_intervals && to_double(values[j].Value, value))
                         {
-                            if (value == "true") value = "1";
-                            if (value == "false") value = "0";
-
-                            sql += std::string(" (") +
-                                std::to_string(id) + " , \'" + sourceTS + "\', " +
-                                value + ", " + std::to_string(results[i].m_dataValues[j].StatusCode) + "),\n";
-                                //value + ", \'" +
-                                //statusOPLevel.toString().toUtf8() + "\' ),\n";
+                            matrix[row * n + slot] = value;
+                            n_values++;
                         }
-
-
-                    }
-//    				else
-//    				{
-//    					fprintf(fp,"%s; ;%s;%s\n",
-//    							nodeToRead.toXmlString().toUtf8(),
-//								//tempValue.toString().toUtf8(),
-//								sourceTS.toString().toUtf8(),
-//								statusOPLevel.toString().toUtf8());
-//
-//    				}
-    			}
-                sql.pop_back();
-                sql.pop_back();
-                sql += ";";
-                if (not_empty)
-                {
-                    if (db)
-                    {
-//                        printf("1: %s\n", sql.c_str());
-                        db->exec( sql.c_str());
                     }
-                    else
-                        csv_fstream.flush();
+                    if (results[i].m_continuationPoint.length() > 0)
+                        next.push_back({slot, i});
                 }
 
+                nodesToRead.clear();
+                nodesToRead.create(next.size());
+                active.clear();
+                for (size_t j = 0; j < next.size(); j++)
+                {
+                    OpcUa_NodeId_CopyTo(&tags.node(next[j].first), &nodesToRead[j].NodeId);
+                    results[next[j].second].m_continuationPoint.copyTo(&nodesToRead[j].ContinuationPoint);
+                    active.push_back(next[j].first);
+                }
+                first_page = false;
+            }
+        }
 
-    		}
-    		//printf("****************************************************************\n\n");
-
-    		while ( results[0].m_continuationPoint.length() > 0 )
-    		{
-    			//    		printf("\n*******************************************************\n");
-    			//    		printf("** More data available                          *******\n");
-    			//    		printf("**        Press x to stop read                  *******\n");
-    			//    		printf("**        Press c to continue                   *******\n");
-    			//    		printf("*******************************************************\n");
-    			//    		int action;
-    			//    		/******************************************************************************/
-    			//    		/* Wait for user command. */
-    			//    		bool waitForInput = true;
-    			//    		while (waitForInput)
-    			//    		{
-    			//    			if ( WaitForKeypress(action) )
-    			//    			{
-    			//    				// x -> Release continuation point
-    			//    				historyReadRawModifiedContext.bReleaseContinuationPoints = OpcUa_True;
-    			//    				waitForInput = false;
-    			//    			}
-    			//    			// Continue
-    			//    			else if ( action == 12 ) waitForInput = false;
-    			//    			// Wait
-    			//    			else UaThread::msleep(100);
-    			//    		}
-    			//    		/******************************************************************************/
-    			UaThread::msleep(pause);
-    			OpcUa_ByteString_Clear(&nodesToRead[0].ContinuationPoint);
-    			results[0].m_continuationPoint.copyTo(&nodesToRead[0].ContinuationPoint);
-    			status = m_pSession->historyReadRawModified(
-    					serviceSettings,
-						historyReadRawModifiedContext,
-						nodesToRead,
-						results,
-						diagnosticInfos);
-    			if ( status.isBad() )
-    			{
-                    fprintf(stderr, "** Error: %s UaSession::historyReadRawModified with CP failed [ret=%s]\n", kks.c_str(), status.toString().toUtf8());
-                    failed_kks << kks << " " << status.toString().toUtf8() << "\n";
-//                    printf("** id %d Node=%s status=%s \n",id, nodeToRead.toXmlString().toUtf8(), status.toString().toUtf8());
-    				break;//return status;
-    			}
-    			else
-    			{
-
-    				for ( i=0; i<results.length(); i++ )
-    				{
-    					UaStatus nodeResult(results[i].m_status);
-                        printf("** ContinuationPoint id %d Results %d Node=%s status=%s length=%d\n", id, i, nodeToRead.toXmlString().toUtf8(), nodeResult.toString().toUtf8(),results[i].m_dataValues.length());
-                        N_rows += results[i].m_dataValues.length();
-                        sql = std::string("INSERT INTO dynamic_data (id,t,val,status) VALUES ");
-
-                        for ( j=0; j<results[i].m_dataValues.length(); j++ )
-    					{
-    						UaStatus statusOPLevel(results[i].m_dataValues[j].StatusCode);
-    						std::string sourceTS = UaDateTime(results[i].m_dataValues[j].SourceTimestamp).toString().toUtf8();
-							sourceTS.pop_back();
-							sourceTS[10] = ' ';
-                            if ( read_bad || OpcUa_IsGood(results[i].m_dataValues[j].StatusCode) )
-    						{
-
-                                std::string value = UaVariant(results[i].m_dataValues[j].Value).toString().toUtf8();
-                                if (!db) // using local csv file
-                                    csv_fstream<<kks<<","<<sourceTS.c_str()<<"," <<
-                                                 value << ",\'" <<
-                                                 statusOPLevel.toString().toUtf8()<<"'\n";
-                                else
-                                {
-                                    if (value == "true") value = "1";
-                                    if (value == "false") value = "0";
-
-                                    sql += std::string(" (") +
-                                        std::to_string(id) + " , \'" + sourceTS + "\', " +
-                                        value + ", " + std::to_string(results[i].m_dataValues[j].StatusCode) + "),\n";
-
-//                                        value + ", \'" +
-//                                        statusOPLevel.toString().toUtf8() + "\' ),\n";
-                                }
-
-
-
-                            }
-//    						else
-//    						{
-//    							fprintf(fp,"%s; ;%s;%s\n",
-//    									nodeToRead.toXmlString().toUtf8(),
-//										//tempValue.toString().toUtf8(),
-//										sourceTS.toString().toUtf8(),
-//										statusOPLevel.toString().toUtf8());
-//    						}
-    					}
-                        sql.pop_back();
-                        sql.pop_back();
-                        sql += ";";
-                        if (j>0)
-                        {
-
-                            if (db)
-                            {
-//                                printf("2: %s\n", sql.c_str());
-                                db->exec( sql.c_str());
-                            }
-                            else
-                                csv_fstream.flush();
-                        }
+        // a chunk with tags not read would be stored as gaps: it is left out
+        if (chunk_failed)
+        {
+            fprintf(stderr, "Error: aggregates %s .. %s are not stored\n",
+                    format_time(chunk_begin).c_str(), format_time(chunk_end).c_str());
+            n_failed++;
+            continue;
+        }
+        for (size_t row = 0; row < n_intervals; row++)
+        {
+            slice s;
+            s.t = chunk_begin + row * interval;
+            s.values.assign(matrix.begin() + row * n, matrix.begin() + (row + 1) * n);
+            writer->push(std::move(s));
+            n_slices++;
+        }
+    }
+    printf("processed history: %llu aggregates in %llu slices, %llu chunks failed\n", (unsigned long long)n_values,
+           (unsigned long long)n_slices, (unsigned long long)n_failed);
+    pacer.print_stats(stdout);
+    return failed.isGood() ? status : failed;
+}
 
-    				}
-    			}
-    		}
-    	}
-        std::cout<<"\nN_rows="<<N_rows<<"\n";
-        if (N_rows > 0)
+void SampleClient::history_worker(int worker, const HistoryReadRawModifiedContext& historyReadRawModifiedContext,
+                                  request_pacer& pacer, int timeout, history_progress& progress, history_pipeline& pipeline,
+                                  UaStatus& status)
+{
+    UaSession* session = m_pSession;
+    if (worker > 0)
+    {
+        session = new UaSession();
+        status = connect_session(session);
+        if (status.isNotGood())
         {
-            N_rows = 0;
-            std::cout<<"\nKKS WITH HISTORY: "<<kks<<"\n";
+            fprintf(stderr, "Error: history worker %d can't connect\n", worker);
+            delete session;
+            return;
+        }
+    }
+	ServiceSettings serviceSettings;
+	serviceSettings.callTimeout = timeout;
 
-            reconnect(pause*3);
+    int64_t range_begin = to_unix_ms(historyReadRawModifiedContext.startTime);
+    int64_t range_end = to_unix_ms(historyReadRawModifiedContext.endTime);
+    HistoryReadRawModifiedContext window_context = historyReadRawModifiedContext;
+    std::vector<history_task> batch;
+    session_recycler recycler(recycle_mode, recycle_limit);
+    while (progress.next(batch, history_batch))
+    {
+        // watchdog: the session is checked between requests, a lost one is opened again
+        if (session->isConnected() == OpcUa_False)
+        {
+            fprintf(stderr, "Error: history worker %d lost its session, reconnecting\n", worker);
+            recycle_session(worker, session, 0);
+            recycler.connected();
         }
+        if (worker == 0 && register_nodes && registration_lost)
+            register_tags();
+        window_context.startTime = UaDateTime(from_unix_ms(batch[0].start));
+        window_context.endTime = UaDateTime(from_unix_ms(batch[0].end));
+        // bounds only at the ends of the whole range: a window touching one of them asks for both
+        // bounds and the one at its inner edge is dropped
+        window_context.returnBounds = historyReadRawModifiedContext.returnBounds &&
+                (batch[0].start == range_begin || batch[0].end == range_end) ? OpcUa_True : OpcUa_False;
+        status = read_history_batch(session, worker, batch, window_context, serviceSettings, pacer, progress, pipeline,
+                                    window_context.returnBounds && batch[0].start != range_begin ? batch[0].start : INT64_MIN,
+                                    window_context.returnBounds && batch[0].end != range_end ? batch[0].end : INT64_MAX);
+        uint64_t batch_rows = 0, tags_with_data = 0;
+        for (history_task& task : batch)
+        {
+            batch_rows += task.window_rows;
+            const std::string& kks = tags.name(task.slot);
+            // the whole window is pushed, so the tag is stored up to its end
+            if (!task.failed && !task.retry)
+                pipeline.push_checkpoint(kks, task.end);
+            if (!progress.window_done(worker, kks, task))
+                continue;
+            std::cout<<"\nN_rows="<<task.rows<<"\n";
+            if (task.rows > 0)
+            {
+                std::cout<<"\nKKS WITH HISTORY: "<<kks<<"\n";
+                tags_with_data++;
+            }
+        }
+        recycler.add(batch_rows, tags_with_data);
+        if (status.isBad() || recycler.due())
+        {
+            recycle_session(worker, session, pacer.delay_ms()*3);
+            recycler.connected();
+        }
+    }
 
+    if (worker > 0)
+    {
+        disconnect_session(session);
+        delete session;
     }
-    if (db)
+}
+
+void SampleClient::release_history_points(UaSession* session, const HistoryReadRawModifiedContext& historyReadRawModifiedContext,
+                                          ServiceSettings& serviceSettings, const UaHistoryReadValueIds& nodes)
+{
+    HistoryReadRawModifiedContext releaseContext = historyReadRawModifiedContext;
+    releaseContext.bReleaseContinuationPoints = OpcUa_True;
+    HistoryReadDataResults results;
+    UaDiagnosticInfos diagnosticInfos;
+    UaStatus status = session->historyReadRawModified(serviceSettings, releaseContext, nodes, results, diagnosticInfos);
+    if (status.isNotGood())
+        fprintf(stderr, "Error: releasing %u continuation points failed [ret=%s]\n", nodes.length(),
+                status.toString().toUtf8());
+}
+
+UaStatus SampleClient::read_history_batch(UaSession* session, int worker, std::vector<history_task>& batch,
+                                          const HistoryReadRawModifiedContext& historyReadRawModifiedContext,
+                                          ServiceSettings& serviceSettings, request_pacer& pacer, history_progress& progress,
+                                          history_pipeline& pipeline, int64_t from, int64_t to)
+{
+    UaStatus                      status;
+	UaDiagnosticInfos             diagnosticInfos;
+	UaHistoryReadValueIds         nodesToRead;
+	HistoryReadDataResults        results;
+
+    for (history_task& task : batch)
     {
-        printf("\noptimizing db\n");
-        db->finalize_db();
+        if (task.id >= 0)
+            continue;
+        if (db)
+            task.id = db->id(tags.name(task.slot));
+        else
+            task.id = task.slot + 1;
+        std::cout<<"\n\nID: "<<task.id<<"\n\n";
     }
 
-    return status;
+    // batch positions of nodes still having data on the server, request i is for node active[i]
+    std::vector<size_t> active(batch.size());
+    std::iota(active.begin(), active.end(), 0);
+	nodesToRead.create(active.size());
+    for (size_t i = 0; i < active.size(); i++)
+    {
+        // registered ids belong to m_pSession, other sessions use node ids from kks file
+        OpcUa_NodeId_CopyTo(worker == 0 ? &tags.node(batch[i].slot) : &tags.source_node(batch[i].slot), &nodesToRead[i].NodeId);
+    }
 
+    bool first_page = true;
+    while (!active.empty())
+    {
+        auto paused = pacer.wait();
+        auto requested = std::chrono::steady_clock::now();
+    	status = session->historyReadRawModified(
+    			serviceSettings,
+				historyReadRawModifiedContext,
+				nodesToRead,
+				results,
+				diagnosticInfos);
+        auto response = std::chrono::steady_clock::now() - requested;
+        pipeline.fetched(response, paused);
+        pacer.done(response, status.statusCode());
+        if ( status.isNotGood() )
+    	{
+            // pacer.done has backed off already; after a push back or a lost session the windows
+            // are read again from their last pushed row, other errors drop the tags
+            bool retry = request_pacer::is_transient(status.statusCode());
+            for (size_t k : active)
+            {
+                fprintf(stderr, "** Error: %s UaSession::historyReadRawModified%s failed [ret=%s]%s\n",
+                        tags.name(batch[k].slot).c_str(), first_page ? "" : " with CP", status.toString().toUtf8(),
+                        retry ? ", retrying" : "");
+                if (retry)
+                    batch[k].retry = true;
+                else
+                {
+                    progress.failed(tags.name(batch[k].slot), status.toString().toUtf8());
+                    batch[k].failed = true;
+                }
+            }
+            // the server may still hold the points sent with the failed request
+            if (!first_page)
+                release_history_points(session, historyReadRawModifiedContext, serviceSettings, nodesToRead);
+            return status;
+    	}
+
+        // (batch position, result index) of nodes returning a continuation point
+        std::vector<std::pair<size_t,OpcUa_UInt32>> next;
+        // the same for dropped nodes, their points are released
+        std::vector<std::pair<size_t,OpcUa_UInt32>> dropped;
+        for (OpcUa_UInt32 i = 0; i < results.length() && i < active.size(); i++)
+        {
+            size_t k = active[i];
+            const std::string& kks = tags.name(batch[k].slot);
+            int id = batch[k].id;
+            UaNodeId nodeToRead(UaString(kks.c_str()),ns);
+            if (from != INT64_MIN || to != INT64_MAX)
+                drop_inner_bounds(results[i].m_dataValues, from, to);
+            if (first_page && results[i].m_dataValues.length() == 0)
+                printf("** id %d Node=%s status=empty_data_warning\n",id, nodeToRead.toXmlString().toUtf8());
+            else if (first_page)
+            {
+                // empty value (e.g. with a Bad status) says nothing about the type
+                const OpcUa_Variant& first_value = results[i].m_dataValues[0].Value;
+                double number;
+                if (first_value.Datatype != OpcUaType_Null && !to_double(first_value, number))
+                {
+                    progress.failed(kks, "text field");
+                    batch[k].failed = true;
+                    printf("** id %d Node=%s status=text_field_warning \n",id, nodeToRead.toXmlString().toUtf8());
+                    // node is dropped from the batch; the session is kept, so the server would hold
+                    // its continuation point until BadNoContinuationPoints
+                    if (results[i].m_continuationPoint.length() > 0)
+                        dropped.push_back({k, i});
+                    continue;
+                }
+            }
+            UaStatus nodeResult(results[i].m_status);
+            printf("** %sid %d Node=%s status=%s length=%d\n", first_page ? "" : "ContinuationPoint ", id,
+                   nodeToRead.toXmlString().toUtf8(), nodeResult.toString().toUtf8(), results[i].m_dataValues.length());
+            batch[k].window_rows += results[i].m_dataValues.length();
+            if ( nodeResult.isNotGood() )
+            {
+                // the window is read again after the back-off, from the last row pushed
+                if (request_pacer::is_push_back(nodeResult.statusCode()))
+                {
+                    pacer.push_back();
+                    batch[k].retry = true;
+                }
+                else
+                    progress.failed(kks, nodeResult.toString().toUtf8());
+                // the window is not read: no checkpoint, the tag is not asked for later windows
+                if (nodeResult.isBad() && !batch[k].retry)
+                    batch[k].failed = true;
+            }
+            // values come in time order
+            OpcUa_UInt32 length = results[i].m_dataValues.length();
+            if (length > 0)
+                batch[k].read_to = to_unix_ms(results[i].m_dataValues[length - 1].SourceTimestamp) + 1;
+            pipeline.push(id, kks, results[i].m_dataValues);
+            if (results[i].m_continuationPoint.length() > 0)
+                (batch[k].failed || batch[k].retry ? dropped : next).push_back({k, i});
+        }
+
+        if (!dropped.empty())
+        {
+            UaHistoryReadValueIds nodesToRelease;
+            nodesToRelease.create(dropped.size());
+            for (size_t j = 0; j < dropped.size(); j++)
+            {
+                size_t k = dropped[j].first;
+                OpcUa_NodeId_CopyTo(worker == 0 ? &tags.node(batch[k].slot) : &tags.source_node(batch[k].slot), &nodesToRelease[j].NodeId);
+                results[dropped[j].second].m_continuationPoint.copyTo(&nodesToRelease[j].ContinuationPoint);
+            }
+            release_history_points(session, historyReadRawModifiedContext, serviceSettings, nodesToRelease);
+        }
+
+        // finished nodes are dropped, the rest are asked again with their own continuation points
+        nodesToRead.clear();
+        nodesToRead.create(next.size());
+        active.clear();
+        for (size_t j = 0; j < next.size(); j++)
+        {
+            size_t k = next[j].first;
+            OpcUa_NodeId_CopyTo(worker == 0 ? &tags.node(batch[k].slot) : &tags.source_node(batch[k].slot), &nodesToRead[j].NodeId);
+            results[next[j].second].m_continuationPoint.copyTo(&nodesToRead[j].ContinuationPoint);
+            active.push_back(k);
+        }
+        first_page = false;
+    }
+    return status;
 }
 
 UaStatus SampleClient::subscribe()
 {
     UaStatus result;
     m_pSampleSubscription = new SampleSubscription(delta, kks_file);
+    if (csv_out.is_open())
+        m_pSampleSubscription->csv = &csv_out;
     result = m_pSampleSubscription->createSubscription(m_pSession);
     if ( result.isGood() )
     {
@@ -1029,6 +1588,90 @@ void SampleClient::printBrowseResults(const UaReferenceDescriptions& referenceDe
 //    return result;
 //}
 
+int database::id(const std::string& kks) const
+{
+    std::shared_lock<std::shared_mutex> lock(ids_mutex);
+    auto it = ids.find(kks);
+    return it == ids.end() ? -1 : it->second;
+}
+
+void database::resolve_ids(const std::vector<std::string>& kks_array)
+{
+    std::unique_lock<std::shared_mutex> lock(ids_mutex);
+    ids.clear();
+    load_ids(ids);
+    int i = 0;
+    for (auto& k : ids)
+        i = std::max(i, k.second);
+    std::cout<<"max id = " << i <<"\n";
+    std::vector<std::pair<int, std::string>> added;
+    for (auto& k : kks_array)
+    {
+        auto it = ids.find(k);
+        if (it == ids.end() || it->second < 1)
+        {
+            ids[k] = ++i;
+            added.emplace_back(i, k);
+        }
+    }
+    if (!added.empty())
+        store_ids(added);
+    printf("%zu tag ids in static_data\n", ids.size());
+}
+
+void database::store_ids(const std::vector<std::pair<int, std::string>>& added)
+{
+    std::string sql = std::string("INSERT INTO static_data (id,name) VALUES ");
+    for (auto& k : added)
+        sql += "(" + std::to_string(k.first) + ", \'" + k.second + "\'),\n";
+    sql.pop_back();
+    sql.pop_back();
+    sql += ";";
+    printf("%s\n",sql.c_str());
+    exec( sql.c_str());
+}
+
+void database::insert_dynamic(const dynamic_rows& rows)
+{
+    std::string sql = std::string("INSERT INTO dynamic_data (id,t,val,status) VALUES ");
+    char value[32];
+    for (size_t i = 0; i < rows.size(); i++)
+    {
+        snprintf(value, sizeof(value), "%.17g", rows.val[i]);
+        sql += std::string(" (") +
+            std::to_string(rows.id[i]) + " , " + timestamp(rows.t[i]) + ", " +
+            value + ", " + std::to_string(rows.status[i]) + "),\n";
+    }
+    sql.pop_back();
+    sql.pop_back();
+    sql += upsert_clause + ";";
+    exec(sql.c_str());
+}
+
+void database::insert_slices(const std::vector<slice>& slices)
+{
+    std::string sql = std::string("INSERT INTO synchro_data ( ");
+    for (auto& k : synchro_columns)
+    {
+        sql += "\"" + k + "\",";
+    }
+    sql += " timestamp) VALUES ";
+    for (auto& s : slices)
+    {
+        sql += "(";
+        for (double v : s.values)
+        {
+            if (std::isnan(v))
+                sql += "null,";
+            else
+                sql += std::to_string(v) + ",";
+        }
+        sql += timestamp(s.t) + "),";
+    }
+    sql.back() = ';';
+    exec(sql.c_str());
+}
+
 sqlite_database::sqlite_database(bool r,const char* f)
 {
     /* Open database */
@@ -1042,11 +1685,79 @@ sqlite_database::sqlite_database(bool r,const char* f)
 
 sqlite_database::~sqlite_database()
 {
+    commit();
+    sqlite3_finalize(insert_stmt);
+    sqlite3_finalize(select_stmt);
     sqlite3_close(sq_db);
 }
 
+void sqlite_database::set_pragmas()
+{
+    if (pragmas_set)
+        return;
+    pragmas_set = true;
+    // WAL: writers don't rewrite the main file on every commit, readers are not blocked
+    exec("PRAGMA journal_mode=WAL;");
+    exec((std::string("PRAGMA synchronous=") + synchronous + ";").c_str());
+}
+
+void sqlite_database::commit()
+{
+    if (in_transaction)
+    {
+        // WAL write and sync of synchronous happen here, they are part of the insert time
+        auto start = std::chrono::steady_clock::now();
+        exec("COMMIT;");
+        insert_time += std::chrono::steady_clock::now() - start;
+        in_transaction = false;
+        transaction_size = 0;
+    }
+}
+
+void sqlite_database::insert_dynamic(const dynamic_rows& rows)
+{
+    auto start = std::chrono::steady_clock::now();
+    if (!bulk)
+        database::insert_dynamic(rows);
+    else
+    {
+        std::string sql = "INSERT INTO dynamic_data (id,t,val,status) VALUES (?,?,?,?)" + upsert_clause + ";";
+        if (!insert_stmt && sqlite3_prepare_v2(sq_db, sql.c_str(), -1, &insert_stmt, nullptr) != SQLITE_OK)
+        {
+            fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(sq_db));
+            insert_stmt = nullptr;
+            return;
+        }
+        if (!in_transaction)
+        {
+            exec("BEGIN;");
+            in_transaction = true;
+        }
+        char t[24];
+        for (size_t i = 0; i < rows.size(); i++)
+        {
+            format_time(rows.t[i], t);
+            sqlite3_bind_int64(insert_stmt, 1, rows.id[i]);
+            sqlite3_bind_text(insert_stmt, 2, t, -1, SQLITE_TRANSIENT);
+            sqlite3_bind_double(insert_stmt, 3, rows.val[i]);
+            sqlite3_bind_int64(insert_stmt, 4, rows.status[i]);
+            if (sqlite3_step(insert_stmt) != SQLITE_DONE)
+                fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(sq_db));
+            sqlite3_reset(insert_stmt);
+        }
+        transaction_size += rows.size();
+    }
+    rows_inserted += rows.size();
+    insert_time += std::chrono::steady_clock::now() - start;
+    // commit() adds its own time
+    if (bulk && (transaction_rows == 0 || transaction_size >= transaction_rows))
+        commit();
+}
+
 void sqlite_database::init_synchro(std::vector<std::string> kks_array)
 {
+    set_pragmas();
+    synchro_columns = kks_array;
     if (kks_array.size()==0)
     {
         printf("no data in kks.csv");
@@ -1075,6 +1786,7 @@ void sqlite_database::init_synchro(std::vector<std::string> kks_array)
 
 void sqlite_database::init_db(std::vector<std::string> kks_array)
 {
+    set_pragmas();
     printf("init sqlite tables\n");
     if (rewrite)
     {
@@ -1113,51 +1825,19 @@ void sqlite_database::init_db(std::vector<std::string> kks_array)
     /* Execute SQL statement */
     exec(sql.c_str());
 
-    int i = 0;
-    if (!rewrite)
+    if (ingest_dedup)
     {
-        sql = "SELECT MAX(id) from static_data";
-        char *zErrMsg = 0;
-        int rc;
-        static int id;
-        id = -1;
-        rc = sqlite3_exec(sq_db, sql.c_str(), [](void *, int argc, char **argv, char **) -> int {
-                              if (argc>0 && argv[0] && std::strlen(argv[0])>0) id = std::atoi(argv[0]);
-                              return 0;
-                           }, 0, &zErrMsg);
-        if( rc != SQLITE_OK ){
-        fprintf(stderr, "SQL error: %s\n", zErrMsg);
-            sqlite3_free(zErrMsg);
-        }
+        // a row of the same tag and time replaces the stored one
+        if (exec("CREATE UNIQUE INDEX IF NOT EXISTS dynamic_data_id_t ON dynamic_data (id, t);") == SQLITE_OK)
+            upsert_clause = " ON CONFLICT(id, t) DO UPDATE SET val = excluded.val, status = excluded.status";
         else
         {
-            if (id > 0)
-                i = id;
+            fprintf(stderr, "Error: dynamic_data has duplicates, run once without --dedup to remove them\n");
+            ingest_dedup = false;
         }
-
-    }
-    std::cout<<"max id = " << i <<"\n";
-    bool need_merge = false;
-    sql = std::string("INSERT INTO static_data (id,name) VALUES ");
-    for (auto k : kks_array)
-    {
-        if (id(k) < 1)
-        {
-            sql += "(" + std::to_string(++i) + ", \'" + k + "\'),\n";
-            need_merge = true;
-        }
-
-    }
-    sql.pop_back();
-    sql.pop_back();
-    sql += ";";
-
-    if (need_merge)
-    {
-        printf("%s\n",sql.c_str());
-        exec( sql.c_str());
     }
 
+    resolve_ids(kks_array);
 
     //exec("CREATE INDEX IF NOT EXISTS \"idd\" ON \"dynamic_data\"(\"id\"  ASC)");
 
@@ -1177,34 +1857,84 @@ int sqlite_database::exec(const char* sql)
 
 }
 
-int sqlite_database::id(std::string kks)
+
+
+void sqlite_database::load_ids(std::unordered_map<std::string, int>& ids)
 {
-    //std::cout<<kks<<"\n";
-    std::string sql = "SELECT id from static_data where name = \"" + kks + "\"";
     char *zErrMsg = 0;
-    int rc;
-    static int id;
-    id = -1;
-    rc = sqlite3_exec(sq_db, sql.c_str(), [](void *, int argc, char **argv, char **) -> int {
-                          //std::cout<<argv[0]<<"\n";
-                          if (argc>0 && argv[0] && std::strlen(argv[0])>0) id = std::atoi(argv[0]);
-                          return 0;
-                       }, 0, &zErrMsg);
+    int rc = sqlite3_exec(sq_db, "SELECT id, name FROM static_data", [](void* map, int argc, char **argv, char **) -> int {
+                              if (argc == 2 && argv[0] && argv[1])
+                                  (*(std::unordered_map<std::string, int>*)map)[argv[1]] = std::atoi(argv[0]);
+                              return 0;
+                          }, &ids, &zErrMsg);
     if( rc != SQLITE_OK ){
-    fprintf(stderr, "SQL error: %s\n", zErrMsg);
+        fprintf(stderr, "SQL error: %s\n", zErrMsg);
         sqlite3_free(zErrMsg);
-        return -1;
     }
-    else
-    {
-        //std::cout<<"\n" << kks<<" id = "<<id<<"\n";
-        return id;
+}
+
+tag_ranges sqlite_database::time_ranges()
+{
+    // t is text YYYY-MM-DD HH:MM:SS.mmm
+    tag_ranges result;
+    char *zErrMsg = 0;
+    int rc = sqlite3_exec(sq_db, "SELECT id, "
+                                 "CAST(strftime('%s', min(t)) AS INTEGER) * 1000 + CAST(substr(min(t), 21, 3) AS INTEGER), "
+                                 "CAST(strftime('%s', max(t)) AS INTEGER) * 1000 + CAST(substr(max(t), 21, 3) AS INTEGER) "
+                                 "FROM dynamic_data GROUP BY id",
+                          [](void* ranges, int argc, char **argv, char **) -> int {
+                              if (argc == 3 && argv[0] && argv[1] && argv[2])
+                                  (*(tag_ranges*)ranges)[std::atoi(argv[0])] = {std::atoll(argv[1]), std::atoll(argv[2])};
+                              return 0;
+                          }, &result, &zErrMsg);
+    if( rc != SQLITE_OK ){
+        fprintf(stderr, "SQL error: %s\n", zErrMsg);
+        sqlite3_free(zErrMsg);
     }
+    return result;
 }
 
+std::vector<int64_t> sqlite_database::stored_times(int id, int64_t from, int64_t to)
+{
+    std::vector<int64_t> result;
+    if (!select_stmt)
+    {
+        // without an index every lookup reads the whole dynamic_data
+        if (!ingest_dedup)
+        {
+            printf("indexing dynamic_data (id, t)\n");
+            exec("CREATE INDEX IF NOT EXISTS dynamic_data_id_t_lookup ON dynamic_data (id, t);");
+        }
+        if (sqlite3_prepare_v2(sq_db, "SELECT CAST(strftime('%s', t) AS INTEGER) * 1000 + CAST(substr(t, 21, 3) AS INTEGER) "
+                                      "FROM dynamic_data WHERE id = ? AND t BETWEEN ? AND ? ORDER BY t",
+                               -1, &select_stmt, nullptr) != SQLITE_OK)
+        {
+            fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(sq_db));
+            select_stmt = nullptr;
+            return result;
+        }
+    }
+    char first[24], last[24];
+    format_time(from, first);
+    format_time(to, last);
+    sqlite3_bind_int64(select_stmt, 1, id);
+    sqlite3_bind_text(select_stmt, 2, first, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(select_stmt, 3, last, -1, SQLITE_TRANSIENT);
+    while (sqlite3_step(select_stmt) == SQLITE_ROW)
+        result.push_back(sqlite3_column_int64(select_stmt, 0));
+    sqlite3_reset(select_stmt);
+    return result;
+}
 
 void sqlite_database::finalize_db()
 {
+    commit();
+    double seconds = std::chrono::duration<double>(insert_time).count();
+    printf("sqlite %s insert: %llu rows in %.3f s, %.0f rows/s\n", bulk ? "prepared" : "text",
+           (unsigned long long)rows_inserted, seconds, seconds > 0 ? rows_inserted / seconds : 0.0);
+    // with the unique (id,t) index there is nothing to delete
+    if (ingest_dedup)
+        return;
     exec("DELETE FROM dynamic_data WHERE rowid NOT IN (\
          SELECT MIN(rowid) FROM dynamic_data GROUP BY id, t, val, status\
        );VACUUM;");
@@ -1228,6 +1958,11 @@ clickhouse_database::~clickhouse_database()
 
 void clickhouse_database::init_synchro(std::vector<std::string> kks_array)
 {
+    synchro_columns = kks_array;
+    synchro_values.clear();
+    for (size_t i = 0; i < kks_array.size(); i++)
+        synchro_values.push_back(std::make_shared<clickhouse::ColumnFloat64>());
+    synchro_time = std::make_shared<clickhouse::ColumnDateTime64>(3);
     if (kks_array.size()==0)
     {
         printf("no data in kks.csv");
@@ -1287,50 +2022,33 @@ void clickhouse_database::init_db(std::vector<std::string> kks_array)
     /* Create SQL statement */
 
     /* Create SQL statement */
+    // ReplacingMergeTree keeps one row per (id,t) of the sorting key
     sql = std::string("CREATE TABLE IF NOT EXISTS  dynamic_data ( id UInt64, t DateTime64(3,'Europe/Moscow'), "
-                      "val Float64, status UInt64 ) ENGINE = MergeTree()"
-                      " PARTITION BY (id,toYYYYMM(t)) ORDER BY (id,t) PRIMARY KEY (id,t)");
+                      "val Float64, status UInt64 ) ENGINE = ") + (ingest_dedup ? "ReplacingMergeTree()" : "MergeTree()") +
+                      " PARTITION BY (id,toYYYYMM(t)) ORDER BY (id,t) PRIMARY KEY (id,t)";
     printf("%s\n",sql.c_str());
     /* Execute SQL statement */
     exec(sql.c_str());
-
-
-
-    int i = 0;
-    if (!rewrite)
+    if (ingest_dedup)
     {
-        sql = "SELECT MAX(id) from static_data;";
-        static int id;
-        id = -1;
-        ch_db->Select(sql.c_str(), [](const clickhouse::Block& block)
-                {   if (block.GetRowCount() == 0) return;
-                    else id = block[0]->As<clickhouse::ColumnUInt64>()->At(0);
+        std::string engine;
+        ch_db->Select("SELECT engine FROM system.tables WHERE database = currentDatabase() AND name = 'dynamic_data'",
+                      [&engine](const clickhouse::Block& block)
+                {
+                    if (block.GetRowCount() > 0)
+                        engine = std::string(block[0]->As<clickhouse::ColumnString>()->At(0));
                 }
             );
-        if (id > 0) i = id;
-    }
-    std::cout<<"max id = " << i <<"\n";
-    bool need_merge = false;
-    sql = std::string("INSERT INTO static_data (id,name) VALUES ");
-    for (auto k : kks_array)
-    {
-        std::cout<<k<<" " << id(k)<<"\n";
-        if (id(k) < 1)
+        if (engine != "ReplacingMergeTree")
         {
-            sql += "(" + std::to_string(++i) + ", \'" + k + "\'),\n";
-            need_merge = true;
+            fprintf(stderr, "Error: dynamic_data is %s, rewrite it (-w) to deduplicate on insert\n", engine.c_str());
+            ingest_dedup = false;
         }
     }
-    sql.pop_back();
-    sql.pop_back();
-    sql += ";";
-    //std::cout<<kks_array.size()<<" elements inserted to static_data\n";
-    if (need_merge)
-    {
-        printf("%s\n",sql.c_str());
-        exec( sql.c_str());
-    }
 
+
+
+    resolve_ids(kks_array);
 }
 
 int clickhouse_database::exec(const char* sql)
@@ -1339,23 +2057,95 @@ int clickhouse_database::exec(const char* sql)
     return 0;
 }
 
-int clickhouse_database::id(std::string kks)
+void clickhouse_database::insert_dynamic(const dynamic_rows& rows)
+{
+    auto id = std::make_shared<clickhouse::ColumnUInt64>();
+    auto t = std::make_shared<clickhouse::ColumnDateTime64>(3);
+    auto val = std::make_shared<clickhouse::ColumnFloat64>();
+    auto status = std::make_shared<clickhouse::ColumnUInt64>();
+    for (size_t i = 0; i < rows.size(); i++)
+    {
+        id->Append(rows.id[i]);
+        t->Append(rows.t[i]);
+        val->Append(rows.val[i]);
+        status->Append(rows.status[i]);
+    }
+    clickhouse::Block block;
+    block.AppendColumn("id", id);
+    block.AppendColumn("t", t);
+    block.AppendColumn("val", val);
+    block.AppendColumn("status", status);
+    ch_db->Insert("dynamic_data", block);
+}
+
+void clickhouse_database::insert_slices(const std::vector<slice>& slices)
+{
+    for (auto& s : slices)
+    {
+        // missing value stays NaN in Float64 column
+        for (size_t i = 0; i < synchro_values.size(); i++)
+            synchro_values[i]->Append(s.values[i]);
+        synchro_time->Append(s.t);
+    }
+    clickhouse::Block block;
+    for (size_t i = 0; i < synchro_values.size(); i++)
+        block.AppendColumn(synchro_columns[i], synchro_values[i]);
+    block.AppendColumn("timestamp", synchro_time);
+    ch_db->Insert("synchro_data", block);
+    for (auto& column : synchro_values)
+        column->Clear();
+    synchro_time->Clear();
+}
+
+
+void clickhouse_database::load_ids(std::unordered_map<std::string, int>& ids)
+{
+    ch_db->Select("SELECT id, name FROM static_data", [&ids](const clickhouse::Block& block)
+            {
+                auto id = block[0]->As<clickhouse::ColumnUInt64>();
+                auto name = block[1]->As<clickhouse::ColumnString>();
+                for (size_t i = 0; i < block.GetRowCount(); i++)
+                    ids[std::string(name->At(i))] = id->At(i);
+            }
+        );
+}
+
+tag_ranges clickhouse_database::time_ranges()
 {
-    std::string sql = std::string("SELECT id FROM static_data WHERE name = \'") + kks + "\'";
-    static int id;
-    id = -1;
-    ch_db->Select(sql.c_str(), [](const clickhouse::Block& block)
+    tag_ranges result;
+    ch_db->Select("SELECT id, toUnixTimestamp64Milli(min(t)), toUnixTimestamp64Milli(max(t)) FROM dynamic_data GROUP BY id",
+                  [&result](const clickhouse::Block& block)
             {
-                if (block.GetRowCount() == 0) return;
-                else id = block[0]->As<clickhouse::ColumnUInt64>()->At(0);
+                auto id = block[0]->As<clickhouse::ColumnUInt64>();
+                auto first = block[1]->As<clickhouse::ColumnInt64>();
+                auto last = block[2]->As<clickhouse::ColumnInt64>();
+                for (size_t i = 0; i < block.GetRowCount(); i++)
+                    result[id->At(i)] = {first->At(i), last->At(i)};
             }
         );
+    return result;
+}
 
-    return id;
+std::vector<int64_t> clickhouse_database::stored_times(int id, int64_t from, int64_t to)
+{
+    std::vector<int64_t> result;
+    ch_db->Select("SELECT toUnixTimestamp64Milli(t) FROM dynamic_data WHERE id = " + std::to_string(id) +
+                  " AND t BETWEEN " + timestamp(from) + " AND " + timestamp(to) + " ORDER BY t",
+                  [&result](const clickhouse::Block& block)
+            {
+                auto t = block[0]->As<clickhouse::ColumnInt64>();
+                for (size_t i = 0; i < block.GetRowCount(); i++)
+                    result.push_back(t->At(i));
+            }
+        );
+    return result;
 }
 
 void clickhouse_database::finalize_db()
 {
+    // ReplacingMergeTree removes duplicates in its background merges
+    if (ingest_dedup)
+        return;
     exec("OPTIMIZE TABLE dynamic_data DEDUPLICATE");
 }
 
@@ -28,16 +28,54 @@
 
 #include "uabase.h"
 #include "uaclientsdk.h"
+#include "tagregistry.h"
+#include "slicewriter.h"
+#include "historyprogress.h"
+#include "sessionrecycler.h"
+#include "csvsink.h"
 #include <map>
 #include <string.h>
 #include <fstream>
 #include <vector>
 #include <numeric>
+#include <chrono>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+#include <shared_mutex>
+#include <unordered_map>
 #include <sqlite3.h>
 #include <clickhouse/client.h>
 
 class SampleSubscription;
 
+// "YYYY-MM-DD HH:MM:SS.mmm" in UTC for milliseconds since epoch
+std::string format_time(int64_t ms);
+// the same into buffer of at least 24 chars
+void format_time(int64_t ms, char* buffer);
+int64_t to_unix_ms(const OpcUa_DateTime&);
+OpcUa_DateTime from_unix_ms(int64_t ms);
+// numeric and boolean scalars straight from the variant union, strings holding a number
+// through UaVariant::toDouble, false for other types
+bool to_double(const OpcUa_Variant&, double&);
+
+// rows of dynamic_data kept in columns
+struct dynamic_rows
+{
+    std::vector<uint64_t> id;
+    std::vector<int64_t> t;    // ms since epoch
+    std::vector<double> val;
+    std::vector<uint64_t> status;
+    size_t size() const {return id.size();}
+    void clear() {id.clear(); t.clear(); val.clear(); status.clear();}
+    void reserve(size_t n) {id.reserve(n); t.reserve(n); val.reserve(n); status.reserve(n);}
+};
+
+// id -> (first, last) t in dynamic_data, ms since epoch
+using tag_ranges = std::map<int, std::pair<int64_t, int64_t>>;
+
 using namespace UaClientSdk;
 
 class database
@@ -49,8 +87,40 @@ public:
     virtual ~database(){};
     virtual void init_synchro(std::vector<std::string>) = 0;
     virtual void finalize_db() = 0;
-    virtual int id(std::string) = 0;
+    // id of the tag in static_data from the cache, -1 - unknown tag; safe from any thread
+    int id(const std::string&) const;
     virtual std::string now() = 0;
+    // SQL literal of the moment ms since epoch
+    virtual std::string timestamp(int64_t ms) = 0;
+    // INSERT INTO dynamic_data ... VALUES by default
+    virtual void insert_dynamic(const dynamic_rows&);
+    // INSERT INTO synchro_data ... VALUES with one row per slice by default
+    virtual void insert_slices(const std::vector<slice>&);
+    // rows were inserted but not committed yet
+    virtual bool uncommitted() const {return false;}
+    virtual void commit() {}
+    virtual tag_ranges time_ranges() = 0;
+    // sorted t of the rows of the tag stored in [from, to], ms since epoch
+    virtual std::vector<int64_t> stored_times(int id, int64_t from, int64_t to) = 0;
+    // duplicates of (id,t) are removed on insert: unique index with upsert (sqlite),
+    // ReplacingMergeTree (ClickHouse) or dropping rows whose (id,t) is in the chunks or open rows
+    // of the tag (column store); finalize_db has nothing to deduplicate then, the column store
+    // only sorts tags whose chunks overlap
+    bool ingest_dedup = false;
+protected:
+    // " ON CONFLICT ..." of INSERT INTO dynamic_data when ingest_dedup
+    std::string upsert_clause;
+    // tag columns of synchro_data, set by init_synchro
+    std::vector<std::string> synchro_columns;
+    // loads static_data into the cache once and adds missing tags with one INSERT, called by init_db
+    void resolve_ids(const std::vector<std::string>&);
+    // SELECT id, name FROM static_data
+    virtual void load_ids(std::unordered_map<std::string, int>&) = 0;
+    // INSERT INTO static_data (id,name) VALUES ... by default
+    virtual void store_ids(const std::vector<std::pair<int, std::string>>&);
+private:
+    std::unordered_map<std::string, int> ids;
+    mutable std::shared_mutex ids_mutex;
 };
 
 class sqlite_database : public database
@@ -62,10 +132,33 @@ public:
     ~sqlite_database();
     void init_synchro(std::vector<std::string>);
     void finalize_db();
-    int id(std::string);
+    void load_ids(std::unordered_map<std::string, int>&);
     std::string now() {return std::string("CURRENT_TIMESTAMP");}
+    std::string timestamp(int64_t ms) {return "'" + format_time(ms) + "'";}
+    // prepared statement with bound values, false - text INSERT of database::insert_dynamic
+    void insert_dynamic(const dynamic_rows&);
+    bool uncommitted() const {return in_transaction;}
+    void commit();
+    tag_ranges time_ranges();
+    // indexes dynamic_data (id, t) on the first call unless the unique index of ingest_dedup is there
+    std::vector<int64_t> stored_times(int, int64_t, int64_t);
+
+    bool bulk = true;
+    // PRAGMA synchronous: OFF, NORMAL, FULL
+    std::string synchronous = "NORMAL";
+    // rows in one transaction, 0 - one transaction per history page
+    size_t transaction_rows = 0;
 private:
     sqlite3 *sq_db;
+    sqlite3_stmt* insert_stmt = nullptr;
+    sqlite3_stmt* select_stmt = nullptr;
+    bool in_transaction = false;
+    bool pragmas_set = false;
+    size_t transaction_size = 0;
+    // ingest statistics
+    uint64_t rows_inserted = 0;
+    std::chrono::steady_clock::duration insert_time{0};
+    void set_pragmas();
 };
 
 class clickhouse_database : public database
@@ -77,12 +170,61 @@ public:
     ~clickhouse_database();
     void init_synchro(std::vector<std::string>);
     void finalize_db();
-    int id(std::string);
+    void load_ids(std::unordered_map<std::string, int>&);
+    tag_ranges time_ranges();
+    std::vector<int64_t> stored_times(int, int64_t, int64_t);
     std::string now() {return std::string("now()");}
+    std::string timestamp(int64_t ms) {return "fromUnixTimestamp64Milli(toInt64(" + std::to_string(ms) + "))";}
+    // native columnar block, ClickHouse doesn't parse text
+    void insert_dynamic(const dynamic_rows&);
+    void insert_slices(const std::vector<slice>&);
 private:
     clickhouse::Client* ch_db;
+    // columns of synchro_data block, built once in init_synchro and reused by every insert
+    std::vector<std::shared_ptr<clickhouse::ColumnFloat64>> synchro_values;
+    std::shared_ptr<clickhouse::ColumnDateTime64> synchro_time;
 };
 
+// running aggregates of online values between two stored slices,
+// one slot per tag, slot is the index of the tag in the kks file
+class slice_accumulator
+{
+public:
+    void resize(size_t n)
+    {
+        sum.assign(n, 0.0);
+        min.assign(n, 0.0);
+        max.assign(n, 0.0);
+        last.assign(n, 0.0);
+        count.assign(n, 0);
+    }
+    void add(size_t slot, double value)
+    {
+        if (count[slot] == 0 || value < min[slot]) min[slot] = value;
+        if (count[slot] == 0 || value > max[slot]) max[slot] = value;
+        sum[slot] += value;
+        last[slot] = value;
+        count[slot]++;
+    }
+    double mean(size_t slot) const {return sum[slot] / count[slot];}
+    void reset()
+    {
+        std::fill(sum.begin(), sum.end(), 0.0);
+        std::fill(count.begin(), count.end(), 0);
+    }
+    size_t size() const {return count.size();}
+
+    std::vector<double> sum;
+    std::vector<double> min;
+    std::vector<double> max;
+    std::vector<double> last;
+    std::vector<unsigned int> count;
+};
+
+class history_pipeline;
+class request_pacer;
+class history_journal;
+
 class SampleClient : public UaSessionCallback
 {
     UA_DISABLE_COPY(SampleClient);
@@ -92,16 +234,24 @@ public:
 
     // UaSessionCallback implementation ----------------------------------------------------
     virtual void connectionStatusChanged(OpcUa_UInt32 clientConnectionId, UaClient::ServerStatus serverStatus);
+    virtual void readComplete(OpcUa_UInt32 transactionId, const UaStatus& result, const UaDataValues& values, const UaDiagnosticInfos& diagnosticInfos);
     // UaSessionCallback implementation ------------------------------------------------------
 
     // OPC UA service calls
     UaStatus connect(std::string);
     UaStatus disconnect();
     UaStatus reconnect(int);
+    UaStatus connect_session(UaSession*);
+    UaStatus disconnect_session(UaSession*);
+    UaStatus reconnect_session(UaSession*, int);
+    UaStatus recycle_session(int, UaSession*, int);
+    void print_session_stats(FILE*) const;
     void online_db_init();
-    UaStatus read_online();
+    UaStatus read_online(std::chrono::system_clock::time_point);
+    UaStatus read_operation_limit(OpcUa_UInt32, OpcUa_UInt32&);
     UaStatus read_once();
     UaStatus readHistory(const char*,const char*,int,int,bool);
+    UaStatus readProcessed(const char*,const char*,int,int);
     UaStatus subscribe();
     UaStatus unsubscribe();
 //    UaStatus returnNames();
@@ -109,6 +259,64 @@ public:
     UaStatus browseInternal(const UaNodeId& nodeToBrowse, OpcUa_UInt32 maxReferencesToReturn, std::string  recursive);
     void printBrowseResults(const UaReferenceDescriptions& referenceDescriptions, std::string type_match);
 
+    // nodes per one Read service call in online mode, 0 - ask server for MaxNodesPerRead
+    OpcUa_UInt32 max_nodes_per_read = 0;
+    // chunks read with beginRead at the same time in online mode, 0 - synchronous read
+    OpcUa_UInt32 max_in_flight = 0;
+    // use RegisterNodes ids for online, snapshot and history reads
+    bool register_nodes = false;
+    // local sqlite ingest: prepared statement, PRAGMA synchronous, rows per transaction (0 - per page)
+    bool sqlite_bulk = true;
+    std::string sqlite_synchronous = "NORMAL";
+    size_t sqlite_transaction_rows = 0;
+    // writer stage of online mode: queue length, slices per insert, longest wait of a slice for insert,
+    // what to do when queue is full
+    size_t writer_queue = 1024;
+    size_t writer_batch = 64;
+    int writer_flush_ms = 1000;
+    slice_writer::overflow_policy writer_overflow = slice_writer::BLOCK;
+    std::string spill_file = "spill.csv";
+    // sessions reading history in parallel, each takes the next tag from a shared queue
+    int history_workers = 1;
+    // nodes per HistoryReadRawModified call, each keeps its own continuation point;
+    // 0 - server MaxNodesPerHistoryReadData or DEFAULT_HISTORY_BATCH if the server has no limit
+    OpcUa_UInt32 history_batch = 1;
+    static const OpcUa_UInt32 DEFAULT_HISTORY_BATCH = 100;
+    // -b/-e range is read in time windows of about history_window_rows rows per tag,
+    // the first window is history_window_s seconds rounded down to 1 s times a power of two
+    // (3600 -> 2048), as all window lengths are; 0 rows - whole range in one window
+    uint64_t history_window_rows = 100000;
+    int history_window_s = 3600;
+    // pages waiting for decoding and decoded pages waiting for insert in history mode
+    size_t history_queue = 16;
+    // bounds of the adaptive delay between history requests, -p is the starting delay;
+    // pause_max 0 - 8 times -p but at least 1 s, equal bounds - fixed pause
+    int pause_min = 10;
+    int pause_max = 0;
+    // history sessions are reopened after errors only or also every recycle_limit tags with data,
+    // rows or minutes; watchdog_ms - keep-alive check of the session by the SDK
+    session_recycler::mode recycle_mode = session_recycler::ERRORS;
+    uint64_t recycle_limit = 0;
+    OpcUa_UInt32 watchdog_ms = 5000;
+    // checkpoints of stored history, resume - continue each tag from its checkpoint
+    std::string journal_file = "history.journal";
+    bool resume = false;
+    // tail mode of history: new data every follow_s seconds (0 - off) up to follow_lag_s before now;
+    // stop_follow ends it after the current cycle
+    int follow_s = 0;
+    int follow_lag_s = 60;
+    std::atomic<bool> stop_follow{false};
+    // deduplicate on insert instead of in finalize_db; drop history rows whose tag and time
+    // are already in dynamic_data
+    bool dedup = false;
+    bool skip_stored = false;
+    // rows per record batch or row group of Arrow and Parquet files
+    size_t arrow_row_group = 1 << 20;
+    // aggregate function node id (OpcUaId_AggregateFunction_*) of readProcessed and its interval
+    OpcUa_UInt32 aggregate = OpcUaId_AggregateFunction_Average;
+    double aggregate_interval_s = 60;
+    static const int64_t AGGREGATE_CHUNK = 1000;
+    void print_online_stats(FILE*) const;
 
 private:
     UaSession*          m_pSession;
@@ -119,13 +327,48 @@ private:
     int delta;
     int mean;
     unsigned short ns;
-    std::map<std::string,std::vector<double>> slice_data;
-    std::vector<std::string> kks_array;
+    slice_accumulator slice_data;
+    tag_registry tags;
+    std::vector<UaReadValueIds> online_requests;
     std::string kks_string;
     FILE* kks_fstream;
     database* db;
-    std::ofstream csv_fstream;
+    csv_sink csv_out;
+    slice_writer* writer;
     void init_db();
+    void configure_db();
+    void synchro_init();
+    void resolve_history_batch();
+    void add_online_values(OpcUa_UInt32, const UaDataValues&);
+    UaStatus read_history_range(const HistoryReadRawModifiedContext&, std::vector<int64_t>&, request_pacer&, int,
+                                history_journal*);
+    UaStatus follow_history(HistoryReadRawModifiedContext&, request_pacer&, int);
+    void history_worker(int, const HistoryReadRawModifiedContext&, request_pacer&, int, history_progress&, history_pipeline&, UaStatus&);
+    // frees continuation points of nodes that are not read further
+    void release_history_points(UaSession*, const HistoryReadRawModifiedContext&, ServiceSettings&,
+                                const UaHistoryReadValueIds&);
+    // values outside [from, to) are bounds at inner window edges and are dropped
+    UaStatus read_history_batch(UaSession*, int, std::vector<history_task>&, const HistoryReadRawModifiedContext&,
+                                ServiceSettings&, request_pacer&, history_progress&, history_pipeline&,
+                                int64_t from, int64_t to);
+    // connect_session calls and session recycles of history workers
+    std::atomic<uint64_t> connects{0};
+    std::atomic<int64_t> connect_us{0};
+    std::atomic<uint64_t> recycles{0};
+    std::atomic<int64_t> recycle_us{0};
+    // db connection and csv file are shared by history workers and the pipeline writer
+    std::mutex db_mutex;
+    void register_tags();
+    std::atomic<bool> registration_lost{false};
+    UaStatus read_online_sync(int&);
+    UaStatus read_online_async(int&);
+
+    // beginRead transactions of the current online cycle: id -> (slot of first tag, count)
+    std::mutex async_mutex;
+    std::condition_variable async_cv;
+    std::map<OpcUa_UInt32, std::pair<OpcUa_UInt32,OpcUa_UInt32>> async_requests;
+    OpcUa_UInt32 async_transaction = 0;
+    UaStatus async_status;
 };
 
 
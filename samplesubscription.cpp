@@ -46,7 +46,6 @@ SampleSubscription::SampleSubscription(int d, std::string k="kks.csv")
 : m_pSession(NULL),
   m_pSubscription(NULL)
 {
-	kks_array = NULL;
 	db = NULL;
 	delta = d;
     kks_file = k;
@@ -54,8 +53,6 @@ SampleSubscription::SampleSubscription(int d, std::string k="kks.csv")
 
 SampleSubscription::~SampleSubscription()
 {
-	delete[] kks_array;
-
     if ( m_pSubscription )
     {
         deleteSubscription();
@@ -85,6 +82,7 @@ void SampleSubscription::dataChange(
     OpcUa_ReferenceParameter(clientSubscriptionHandle); // We use the callback only for this subscription
     OpcUa_ReferenceParameter(diagnosticInfos);
     OpcUa_UInt32 i = 0;
+    std::string lines;
 
 
     for ( i=0; i<dataNotifications.length(); i++ )
@@ -94,13 +92,24 @@ void SampleSubscription::dataChange(
             UaVariant tempValue = dataNotifications[i].Value.Value;
             time_t time = UaDateTime(dataNotifications[i].Value.SourceTimestamp).toTime_t(); //. dwHighDateTime;
             OpcUa_Double val;
-            std::string kks_name = kks_array[dataNotifications[i].ClientHandle];
+            const std::string& kks_name = tags.name(dataNotifications[i].ClientHandle);
             std::string value_str = UaVariant(tempValue).toString().toUtf8();
             if (value_str == "true") val = 1;
             if (value_str == "false") val = 0;
             else tempValue.toDouble(val);
 
-            std::cout<< "\"-\" \""<< kks_name <<"\" \"" <<time << "\" \"" << val << "\""<< std::endl	;
+            if (csv)
+            {
+                lines.append(kks_name).append(1, ',');
+                csv_append_time(lines, (int64_t)time * 1000 + UaDateTime(dataNotifications[i].Value.SourceTimestamp).msec());
+                lines.append(1, ',');
+                csv_append_double(lines, val);
+                lines.append(1, ',');
+                csv_append_int(lines, dataNotifications[i].Value.StatusCode);
+                lines.append(1, '\n');
+            }
+            else
+                std::cout<< "\"-\" \""<< kks_name <<"\" \"" <<time << "\" \"" << val << "\""<< std::endl	;
 		//"-" "INCONT.as_M.AM.10HAD99AM001-AM_1.Q" "1747934810" "45"
             //			(slice_data[kks_name])[iteration_count[kks_name]] = val;
 //			std::cout<<  "id: " << kks_name << "[" << iteration_count[kks_name] << "]" <<  " = " << tempValue.toString().toUtf8() << "==" << val << "\n";
@@ -142,10 +151,12 @@ void SampleSubscription::dataChange(
         else
         {
             UaStatus itemError(dataNotifications[i].Value.StatusCode);
-            fprintf(stderr, "  Variable %s failed with status %s\n", kks_array[dataNotifications[i].ClientHandle].c_str(), itemError.toString().toUtf8());
+            fprintf(stderr, "  Variable %s failed with status %s\n", tags.name(dataNotifications[i].ClientHandle).c_str(), itemError.toString().toUtf8());
         }
     }
 //    printf("------------------------------------------------------------\n");
+    if (csv && !lines.empty())
+        csv->write(lines);
 
 
 
@@ -266,36 +277,20 @@ UaStatus SampleSubscription::createMonitoredItems()
     
     UaMonitoredItemCreateResults createResults;
 
-    std::fstream infile(kks_file.c_str());
     int ns = 1;
-    int item_index = 0;
-    std::string kks;
-    while (infile >> kks)
+    tags.load(kks_file, ns);
+    itemsToCreate.resize(tags.size());
+    for (size_t item_index = 0; item_index < tags.size(); item_index++)
     {
-//        printf("%s\n", kks.c_str());
-    	itemsToCreate.resize(item_index+1);
     	itemsToCreate[item_index].ItemToMonitor.AttributeId = OpcUa_Attributes_Value;
-    	UaNodeId test(UaString(kks.c_str()),ns);
-    	test.copyTo(&itemsToCreate[item_index].ItemToMonitor.NodeId);
+    	OpcUa_NodeId_CopyTo(&tags.node(item_index), &itemsToCreate[item_index].ItemToMonitor.NodeId);
     	itemsToCreate[item_index].RequestedParameters.ClientHandle = item_index;
     	itemsToCreate[item_index].RequestedParameters.SamplingInterval = 100;
     	itemsToCreate[item_index].RequestedParameters.QueueSize = 1;
     	itemsToCreate[item_index].RequestedParameters.DiscardOldest = OpcUa_True;
     	itemsToCreate[item_index].MonitoringMode = OpcUa_MonitoringMode_Reporting;
-//        printf("%d%s\n",item_index,kks.c_str());
-	item_index++;
+    	iteration_count[tags.name(item_index)]=0;
     }
-    infile.close();
-
-    kks_array = new std::string[item_index];
-    std::fstream infile_reoprn(kks_file.c_str());
-    item_index = 0;
-    while (infile_reoprn >> kks)
-    {
-    	kks_array[item_index] = kks;
-    	iteration_count[kks]=0;
-    	item_index++;
-	}
 
 //    init_db();
 
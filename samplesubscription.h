@@ -28,6 +28,8 @@
 
 #include "uabase.h"
 #include "uaclientsdk.h"
+#include "tagregistry.h"
+#include "csvsink.h"
 #include <string>
 #include <map>
 #include <sqlite3.h>
@@ -64,13 +66,16 @@ public:
     // Create monitored items in the subscription
     UaStatus createMonitoredItems();
 
+    // values are appended here as id, timestamp, value, code rows instead of stdout, may be null
+    csv_sink* csv = nullptr;
+
 private:
     void init_db();
     UaSession*                  m_pSession;
     UaSubscription*             m_pSubscription;
     int delta;
     std::map<std::string,double[N]> slice_data;
-    std::string* kks_array;
+    tag_registry tags;
     std::map<std::string,int> iteration_count;
     std::string kks_file;
 
@@ -0,0 +1,59 @@
+#include "sessionrecycler.h"
+#include <cstdlib>
+
+session_recycler::session_recycler(mode m, uint64_t l)
+    : policy(m), limit(l), since(std::chrono::steady_clock::now())
+{
+}
+
+bool session_recycler::parse(const std::string& s, mode& m, uint64_t& limit)
+{
+    if (s == "errors")
+    {
+        m = ERRORS;
+        limit = 0;
+        return true;
+    }
+    size_t colon = s.find(':');
+    if (colon == std::string::npos)
+        return false;
+    std::string name = s.substr(0, colon);
+    if (name == "tags")
+        m = TAGS;
+    else if (name == "rows")
+        m = ROWS;
+    else if (name == "minutes")
+        m = MINUTES;
+    else
+        return false;
+    limit = strtoull(s.c_str() + colon + 1, NULL, 10);
+    return limit > 0;
+}
+
+void session_recycler::connected()
+{
+    rows = 0;
+    tags = 0;
+    since = std::chrono::steady_clock::now();
+}
+
+void session_recycler::add(uint64_t r, uint64_t t)
+{
+    rows += r;
+    tags += t;
+}
+
+bool session_recycler::due() const
+{
+    switch (policy)
+    {
+    case TAGS:
+        return tags >= limit;
+    case ROWS:
+        return rows >= limit;
+    case MINUTES:
+        return std::chrono::steady_clock::now() - since >= std::chrono::minutes(limit);
+    default:
+        return false;
+    }
+}
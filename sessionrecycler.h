@@ -0,0 +1,39 @@
+#ifndef SESSIONRECYCLER_H
+#define SESSIONRECYCLER_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// when a history session is closed and opened again: after errors only (a failed service
+// call or a lost connection found by the watchdog), or also after limit tags with data,
+// limit rows or limit minutes since it was opened
+class session_recycler
+{
+public:
+    enum mode
+    {
+        ERRORS,
+        TAGS,
+        ROWS,
+        MINUTES
+    };
+
+    session_recycler(mode, uint64_t limit);
+
+    // "errors", "tags:N", "rows:N" or "minutes:N"
+    static bool parse(const std::string&, mode&, uint64_t& limit);
+
+    void connected();
+    void add(uint64_t rows, uint64_t tags_with_data);
+    bool due() const;
+
+private:
+    mode policy;
+    uint64_t limit;
+    uint64_t rows = 0;
+    uint64_t tags = 0;
+    std::chrono::steady_clock::time_point since;
+};
+
+#endif // SESSIONRECYCLER_H
@@ -92,6 +92,15 @@ if __name__ == '__main__':
         print("unknown out format: clickhouse, sqlite or csv available")
         exit(1)
 
+    # dynamic_data written with --dedup is a ReplacingMergeTree: rows of the same (id,t) stay
+    # until a background merge, FINAL merges them while reading
+    dynamic_table = "dynamic_data"
+    if in_format == "clickhouse":
+        engine = client_in.command("SELECT engine FROM system.tables "
+                                   "WHERE database = currentDatabase() AND name = 'dynamic_data'")
+        if engine == "ReplacingMergeTree":
+            dynamic_table = "dynamic_data FINAL"
+
     print("\nin: "+in_format)
     print("\nout: " + out_format)
 
@@ -161,7 +170,7 @@ if __name__ == '__main__':
         print(kks)
 
         sql = ("SELECT t as timestamp,val as value FROM "
-               "dynamic_data JOIN static_data ON static_data.id=dynamic_data.id WHERE name=\'" +
+               + dynamic_table + " JOIN static_data ON static_data.id=dynamic_data.id WHERE name=\'" +
                kks + "\' and t > \'" + args.interval[0]+ "\' and t < \'" +
                args.interval[1] + "\'")
         print(sql)
@@ -0,0 +1,126 @@
+#include "slicewriter.h"
+#include "sampleclient.h"
+#include "csvsink.h"
+#include <cmath>
+
+slice_writer::slice_writer(database* d, csv_sink* csv, size_t capacity, size_t b, int flush_ms,
+                           overflow_policy p, std::string spill)
+    : db(d), csv_out(csv), batch(b > 0 ? b : 1), flush_interval(flush_ms), policy(p), spill_file(spill), queue(capacity)
+{
+    thread = std::thread(&slice_writer::run, this);
+}
+
+slice_writer::~slice_writer()
+{
+    // writer drains the queue before it exits
+    stop = true;
+    wake.notify_one();
+    thread.join();
+    print_stats(stdout);
+}
+
+void slice_writer::push(slice&& s)
+{
+    pushed++;
+    while (!queue.try_push(s))
+    {
+        if (policy == DROP_OLDEST)
+        {
+            slice oldest;
+            if (queue.try_pop(oldest))
+                dropped++;
+        }
+        else if (policy == SPILL)
+        {
+            if (!spill_fstream.is_open())
+            {
+                spill_fstream.open(spill_file, std::ios::app);
+                fprintf(stderr, "Error: writer queue is full, spilling slices to %s\n", spill_file.c_str());
+            }
+            std::string line;
+            append_values(line, s);
+            spill_fstream << line << "\n";
+            spill_fstream.flush();
+            spilled++;
+            return;
+        }
+        else
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    uint64_t depth = queue.depth();
+    if (depth > max_depth)
+        max_depth = depth;
+    wake.notify_one();
+}
+
+// csv line: values separated by comma, missing values as null, then the timestamp
+void slice_writer::append_values(std::string& out, const slice& s)
+{
+    for (double v : s.values)
+    {
+        if (std::isnan(v))
+            out += "null,";
+        else
+        {
+            csv_append_double(out, v);
+            out += ',';
+        }
+    }
+    csv_append_time(out, s.t);
+}
+
+void slice_writer::write(std::vector<slice>& slices)
+{
+    if (db)
+        db->insert_slices(slices);
+    else
+    {
+        std::string lines;
+        lines.reserve(slices.size() * (slices[0].values.size() * 12 + 32));
+        for (auto& s : slices)
+        {
+            append_values(lines, s);
+            lines += '\n';
+        }
+        csv_out->write(lines);
+    }
+    written += slices.size();
+    batches++;
+}
+
+void slice_writer::run()
+{
+    std::vector<slice> slices;
+    slice s;
+    auto first = std::chrono::steady_clock::now();
+    for (;;)
+    {
+        bool stopping = stop;
+        while (slices.size() < batch && queue.try_pop(s))
+        {
+            if (slices.empty())
+                first = std::chrono::steady_clock::now();
+            slices.push_back(std::move(s));
+        }
+        if (!slices.empty() && (slices.size() >= batch || stopping ||
+                                std::chrono::steady_clock::now() - first >= flush_interval))
+        {
+            write(slices);
+            slices.clear();
+            continue;
+        }
+        if (stopping)
+            break;
+        std::unique_lock<std::mutex> lock(wake_mutex);
+        // push() notifies without the lock, so a wakeup can be missed - poll as well
+        wake.wait_for(lock, std::chrono::milliseconds(10));
+    }
+}
+
+void slice_writer::print_stats(FILE* out) const
+{
+    fprintf(out, "slice writer: queue depth=%zu/%zu max depth=%llu pushed=%llu written=%llu in %llu batches dropped=%llu spilled=%llu\n",
+            queue.depth(), queue.capacity(), (unsigned long long)max_depth.load(), (unsigned long long)pushed.load(),
+            (unsigned long long)written.load(), (unsigned long long)batches.load(),
+            (unsigned long long)dropped.load(), (unsigned long long)spilled.load());
+}
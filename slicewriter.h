@@ -0,0 +1,147 @@
+#ifndef SLICEWRITER_H
+#define SLICEWRITER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class database;
+class csv_sink;
+
+// one online slice: mean of every tag (NaN - no values) at tick t
+struct slice
+{
+    int64_t t;  // ms since epoch
+    std::vector<double> values;
+};
+
+// bounded lock-free ring (D. Vyukov's sequence-numbered cells), written by one thread.
+// Read by the writer thread; the producer may also pop to drop the oldest entry
+template <class T>
+class slice_ring
+{
+public:
+    explicit slice_ring(size_t capacity)
+    {
+        size_t n = 2;
+        while (n < capacity)
+            n <<= 1;
+        cells = std::vector<cell>(n);
+        mask = n - 1;
+        for (size_t i = 0; i < n; i++)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // producer only
+    bool try_push(T& value)
+    {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        cell& c = cells[pos & mask];
+        if (c.sequence.load(std::memory_order_acquire) != pos)
+            return false; // full, or the oldest cell is still being read
+        c.data = std::move(value);
+        c.sequence.store(pos + 1, std::memory_order_release);
+        enqueue_pos.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T& value)
+    {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        cell* c;
+        for (;;)
+        {
+            c = &cells[pos & mask];
+            size_t seq = c->sequence.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (dif == 0)
+            {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (dif < 0)
+                return false; // empty
+            else
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+        }
+        value = std::move(c->data);
+        c->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t depth() const
+    {
+        size_t head = enqueue_pos.load(std::memory_order_acquire);
+        size_t tail = dequeue_pos.load(std::memory_order_acquire);
+        return head > tail ? head - tail : 0;
+    }
+    size_t capacity() const {return mask + 1;}
+
+private:
+    struct cell
+    {
+        std::atomic<size_t> sequence;
+        T data;
+        cell() : sequence(0) {}
+    };
+    std::vector<cell> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueue_pos{0};
+    alignas(64) std::atomic<size_t> dequeue_pos{0};
+};
+
+// writer stage of online mode: the sampling loop pushes finished slices,
+// the writer thread stores them to synchro_data or to the csv file
+// in one insert per batch slices or per flush_ms, what comes first
+class slice_writer
+{
+public:
+    enum overflow_policy
+    {
+        BLOCK,          // sampler waits for a free place
+        DROP_OLDEST,    // oldest queued slice is discarded
+        SPILL           // slice is appended to spill file
+    };
+
+    slice_writer(database*, csv_sink*, size_t capacity, size_t batch, int flush_ms,
+                 overflow_policy, std::string spill_file);
+    ~slice_writer();
+
+    void push(slice&&);
+    void print_stats(FILE*) const;
+
+private:
+    void run();
+    void write(std::vector<slice>&);
+    static void append_values(std::string&, const slice&);
+
+    database* db;
+    csv_sink* csv_out;
+    size_t batch;
+    std::chrono::milliseconds flush_interval;
+    overflow_policy policy;
+    std::string spill_file;
+    std::ofstream spill_fstream;
+
+    slice_ring<slice> queue;
+    std::thread thread;
+    std::atomic<bool> stop{false};
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+
+    std::atomic<uint64_t> pushed{0};
+    std::atomic<uint64_t> written{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> spilled{0};
+    std::atomic<uint64_t> batches{0};
+    std::atomic<uint64_t> max_depth{0};
+};
+
+#endif // SLICEWRITER_H
@@ -0,0 +1,86 @@
+#include "tagregistry.h"
+#include <fstream>
+#include <algorithm>
+
+bool tag_registry::load(const std::string& kks_file, unsigned short ns)
+{
+    std::fstream infile(kks_file.c_str());
+    std::string kks;
+
+    kks_array.clear();
+    while (infile >> kks)
+    {
+        kks_array.push_back(kks);
+    }
+
+    nodes.clear();
+    registered.clear();
+    nodes.create(kks_array.size());
+    for (size_t i = 0; i < kks_array.size(); i++)
+    {
+        UaNodeId(UaString(kks_array[i].c_str()),ns).copyTo(&nodes[i]);
+    }
+    if (kks_array.empty())
+        fprintf(stderr, "Error: no tags in %s\n", kks_file.c_str());
+    return !kks_array.empty();
+}
+
+void tag_registry::build_read_requests(std::vector<UaReadValueIds>& requests, OpcUa_UInt32 count) const
+{
+    OpcUa_UInt32 n_tags = kks_array.size();
+    if (count == 0)
+        count = n_tags;
+
+    requests.clear();
+    requests.resize(n_tags ? (n_tags + count - 1) / count : 0);
+    for (size_t r = 0; r < requests.size(); r++)
+    {
+        OpcUa_UInt32 offset = r * count;
+        OpcUa_UInt32 length = std::min(count, n_tags - offset);
+        requests[r].create(length);
+        for (OpcUa_UInt32 i = 0; i < length; i++)
+        {
+            requests[r][i].AttributeId = OpcUa_Attributes_Value;
+            OpcUa_NodeId_CopyTo(&nodes[offset + i], &requests[r][i].NodeId);
+        }
+    }
+}
+
+UaStatus tag_registry::register_nodes(UaSession* session, OpcUa_UInt32 count)
+{
+    UaStatus        result;
+    ServiceSettings serviceSettings;
+    OpcUa_UInt32    n_tags = kks_array.size();
+    if (count == 0)
+        count = n_tags;
+
+    registered.clear();
+    UaNodeIdArray ids;
+    ids.create(n_tags);
+    for (OpcUa_UInt32 offset = 0; offset < n_tags; offset += count)
+    {
+        OpcUa_UInt32 length = std::min(count, n_tags - offset);
+        UaNodeIdArray nodesToRegister;
+        UaNodeIdArray registeredNodes;
+        nodesToRegister.create(length);
+        for (OpcUa_UInt32 i = 0; i < length; i++)
+        {
+            OpcUa_NodeId_CopyTo(&nodes[offset + i], &nodesToRegister[i]);
+        }
+        result = session->registerNodes(serviceSettings, nodesToRegister, registeredNodes);
+        if (result.isGood() && registeredNodes.length() != length)
+            result = OpcUa_BadInternalError;
+        if (result.isNotGood())
+        {
+            fprintf(stderr, "Error: RegisterNodes failed with status %s, using node ids from kks file\n", result.toString().toUtf8());
+            return result;
+        }
+        for (OpcUa_UInt32 i = 0; i < length; i++)
+        {
+            OpcUa_NodeId_CopyTo(&registeredNodes[i], &ids[offset + i]);
+        }
+    }
+    registered = ids;
+    printf("registered %u nodes\n", n_tags);
+    return result;
+}
@@ -0,0 +1,44 @@
+#ifndef TAGREGISTRY_H
+#define TAGREGISTRY_H
+
+#include "uabase.h"
+#include "uaclientsdk.h"
+#include "uasession.h"
+#include <string>
+#include <vector>
+
+using namespace UaClientSdk;
+
+// tags of the kks file: names and node ids, parsed once at startup
+// slot of the tag is its line number in the kks file
+class tag_registry
+{
+    UA_DISABLE_COPY(tag_registry);
+public:
+    tag_registry() {}
+
+    bool load(const std::string& kks_file, unsigned short ns);
+    size_t size() const {return kks_array.size();}
+    const std::vector<std::string>& names() const {return kks_array;}
+    const std::string& name(size_t slot) const {return kks_array[slot];}
+    // registered node id of the current session if any, else node id from kks file
+    const OpcUa_NodeId& node(size_t slot) const {return registered.length() ? registered[slot] : nodes[slot];}
+    // node id from kks file, valid in any session
+    const OpcUa_NodeId& source_node(size_t slot) const {return nodes[slot];}
+
+    // RegisterNodes for all tags, count tags per call (0 - all tags in one call)
+    UaStatus register_nodes(UaSession*, OpcUa_UInt32 count);
+    // registered ids are valid only in the session they were registered in
+    void clear_registered() {registered.clear();}
+    bool is_registered() const {return registered.length() > 0;}
+
+    // Value attribute read requests, count tags per request (0 - all tags in one request)
+    void build_read_requests(std::vector<UaReadValueIds>&, OpcUa_UInt32 count) const;
+
+private:
+    std::vector<std::string> kks_array;
+    UaNodeIdArray nodes;
+    UaNodeIdArray registered;
+};
+
+#endif // TAGREGISTRY_H